@@ -2,6 +2,7 @@
 
 #include "common.h"
 
+#include <cstddef> // offsetof
 #include <cstring> // memcpy
 #include <vector>
 
@@ -71,6 +72,10 @@ public:
 	{
 		f_outStream.insert(f_outStream.end(), m_tag.begin(), m_tag.end());
 	}
+	void serialize(Tag::GatherList& f_outList) final override
+	{
+		f_outList.addSpan(m_tag.data(), m_tag.size());
+	}
 
 	size_t getSize() const final override { return m_tag.size(); }
 
@@ -78,80 +83,158 @@ private:
 	std::vector<uchar> m_tag;
 };
 
+// Returns the end of the items or nullptr if they do not fit into f_ioSize bytes
+static const uchar* skipItems(const uchar* f_data, size_t& f_ioSize, uint f_items)
+{
+	auto pData = f_data;
+	auto size = f_ioSize;
+	for(uint i = 0; i < f_items; i++)
+	{
+		auto& ii = *reinterpret_cast<const Item*>(pData);
+		if(size < sizeof(ii))
+			return nullptr;
+		size -= sizeof(ii);
+
+		for(pData = reinterpret_cast<const uchar*>(ii.Key); *pData && size; ++pData, --size) {}
+		if(!size)
+			return nullptr;
+
+		pData += 1/*NULL*/;
+		--size;
+		if(size < ii.Size)
+			return nullptr;
+		pData += ii.Size;
+		size -= ii.Size;
+	}
+	f_ioSize = size;
+	return pData;
+}
+
 // ====================================
 namespace Tag
 {
 	size_t IAPE::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size)
 	{
-		// Negative size is a result of parsing a footer-only tag, and now
-		// the function is called with an offset pointing to the beginning
-		// of that tag, and the real tag size should be returned now
-		static const auto maxTagSize = std::numeric_limits<decltype(Header_t::Size)>::max();
-		if(f_size > maxTagSize)
-		{
-			auto& f = *reinterpret_cast<const Header_t*>(f_data + f_offset + -f_size);
-			ASSERT(f.isValidFooter());
-			return (-f_size + sizeof(f));
-		}
+		Status status;
+		auto size = getSize(f_data, f_offset, f_size, status);
+		ASSERT_MSG(status.ok() || status.isAbsent(), status.str());
+		return size;
+	}
 
-		// Check header/footer (there might be no header)
+	size_t IAPE::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+
+		// Check header (tags without one are found by getTrailingSize)
 		auto& h = *reinterpret_cast<const Header_t*>(f_data + f_offset);
-		if(sizeof(h) > f_size)
+		if(sizeof(h) > f_size || !h.isValidHeader())
+		{
+			f_status.error = Status::ErrNotFound;
 			return 0;
+		}
 		auto size = f_size - sizeof(h);
 
-		auto offset = f_offset + sizeof(h);
-		if(h.isValidHeader())
+		// Parse items
+		auto pData = skipItems(reinterpret_cast<const uchar*>(&h + 1), /*io*/size, h.Items);
+		if(!pData)
 		{
-			ASSERT(h.Size == sizeof(h));
+			f_status = Status{Status::ErrTruncated, f_size};
+			return 0;
 		}
-		else if(h.isValidFooter())
+
+		// Check footer
+		auto& f = *reinterpret_cast<const Header_t*>(pData);
+		if(size < sizeof(f))
 		{
-			ASSERT(h.Version == 2000);
-			offset -= h.Size;
-			size += h.Size;
-			ASSERT(offset < f_offset);
+			f_status = Status{Status::ErrTruncated, f_size};
+			return 0;
 		}
-		else
+		auto tagSize = reinterpret_cast<const uchar*>(&f + 1) - reinterpret_cast<const uchar*>(&h);
+		if(!f.isValidFooter() ||
+		   f.Size != tagSize - sizeof(h) ||
+		   h.Size != f.Size ||
+		   h.Items != f.Items)
+		{
+			f_status = Status{Status::ErrInvalidFooter, static_cast<size_t>(pData - reinterpret_cast<const uchar*>(&h))};
 			return 0;
+		}
 
-		// Parse items
-		auto pData = f_data + offset;
-		for(uint i = 0; i < h.Items; i++)
+		return tagSize;
+	}
+
+	size_t IAPE::getTrailingSize(const unsigned char* f_data, size_t f_end, Status& f_status)
+	{
+		Probe probe;
+		auto tagSize = IAPE::probe(f_data, f_end, probe, f_status);
+		if(!tagSize)
+			return 0;
+		if(tagSize > f_end)
 		{
-			auto& ii = *reinterpret_cast<const Item*>(pData);
-			if(size < sizeof(ii))
-				return 0;
-			size -= sizeof(ii);
+			f_status = Status{Status::ErrTruncated, 0};
+			return tagSize;
+		}
+		auto& f = *reinterpret_cast<const Header_t*>(f_data + f_end - sizeof(Header_t));
+		auto pTag = f_data + f_end - tagSize;
 
-			for(pData = reinterpret_cast<const uchar*>(ii.Key); *pData && size; ++pData, --size) {}
-			if(!size)
+		if(f.Flags.HasHeader)
+		{
+			auto& h = *reinterpret_cast<const Header_t*>(pTag);
+			if(!h.isValidHeader() || h.Size != f.Size || h.Items != f.Items)
+			{
+				f_status = Status{Status::ErrInvalidHeader, f_end - tagSize};
 				return 0;
+			}
+		}
 
-			pData += 1/*NULL*/ + ii.Size;
-			if(size < ii.Size)
-				return 0;
-			size -= ii.Size;
+		// Items must end exactly at the footer
+		auto itemsOffset = tagSize - f.Size;
+		auto size = f.Size - sizeof(f);
+		auto pEnd = skipItems(pTag + itemsOffset, /*io*/size, f.Items);
+		if(!pEnd || size)
+		{
+			f_status = Status{Status::ErrInvalidItem, f_end - tagSize + itemsOffset};
+			return 0;
 		}
 
-		// Check footer
-		auto& f = *reinterpret_cast<const Header_t*>(pData);
-		if(offset < f_offset)
+		return tagSize;
+	}
+
+	size_t IAPE::probeSize()
+	{
+		return sizeof(Header_t);
+	}
+
+	size_t IAPE::probe(const unsigned char* f_data, size_t f_end, Probe& f_probe, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+		f_probe = Probe{0, 0, 0};
+
+		if(f_end < sizeof(Header_t))
 		{
-			// Footer-only mode
-			ASSERT(&h == &f);
-			return (offset - f_offset);
+			f_status.error = Status::ErrNotFound;
+			return 0;
 		}
-		else
+		auto footerOffset = f_end - sizeof(Header_t);
+		auto& f = *reinterpret_cast<const Header_t*>(f_data + footerOffset);
+		if(!f.isValidFooter())
 		{
-			if(size < sizeof(f) || !f.isValidFooter())
-				return 0;
-			size -= sizeof(f);
-			ASSERT(f.Size == reinterpret_cast<const uchar*>(&f + 1) - reinterpret_cast<const uchar*>(&h + 1));
-			ASSERT(h.Items == f.Items);
-
-			return (reinterpret_cast<const uchar*>(&f + 1) - reinterpret_cast<const uchar*>(&h));
+			f_status.error = Status::ErrNotFound;
+			return 0;
 		}
+		if(f.Version != 1000 && f.Version != 2000)
+		{
+			f_status = Status{Status::ErrUnsupported, footerOffset + offsetof(Header_t, Version)};
+			return 0;
+		}
+		if(f.Size < sizeof(f))
+		{
+			f_status = Status{Status::ErrInvalidFooter, footerOffset + offsetof(Header_t, Size)};
+			return 0;
+		}
+
+		// The header (APEv2 only) is not counted in the size
+		f_probe = Probe{f.Version, f.Flags.uCell, f.Size + (f.Flags.HasHeader ? sizeof(Header_t) : 0)};
+		return f_probe.size;
 	}
 
 	std::shared_ptr<IAPE> IAPE::create(const unsigned char* f_data, size_t f_offset, size_t f_size)
@@ -0,0 +1,128 @@
+#include "arena.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring> // memcpy
+
+
+static uchar* alignUp(uchar* f_ptr, size_t f_align)
+{
+	auto p = reinterpret_cast<uintptr_t>(f_ptr);
+	return reinterpret_cast<uchar*>((p + f_align - 1) & ~(f_align - 1));
+}
+
+// ====================================
+CArena::CArena(size_t f_blockSize):
+	m_blockSize(f_blockSize),
+	m_blocks(nullptr),
+	m_block(nullptr),
+	m_large(nullptr),
+	m_pos(nullptr),
+	m_end(nullptr),
+	m_last(nullptr),
+	m_capacity(0)
+{}
+
+
+CArena::~CArena()
+{
+	freeBlocks(m_blocks);
+	freeBlocks(m_large);
+}
+
+
+CArena::Block* CArena::newBlock(size_t f_size)
+{
+	auto block = static_cast<Block*>(malloc(sizeof(Block) + f_size));
+	if(!block)
+		throw std::bad_alloc();
+
+	block->Next = nullptr;
+	block->Size = f_size;
+	return block;
+}
+
+
+void CArena::freeBlocks(Block* f_block)
+{
+	while(f_block)
+	{
+		auto next = f_block->Next;
+		m_capacity -= f_block->Size;
+		free(f_block);
+		f_block = next;
+	}
+}
+
+
+void* CArena::allocate(size_t f_size, size_t f_align)
+{
+	auto p = alignUp(m_pos, f_align);
+	if(m_pos && p <= m_end && f_size <= static_cast<size_t>(m_end - p))
+	{
+		m_pos = p + f_size;
+		m_last = p;
+		return p;
+	}
+
+	// Large requests get a block of their own, so the current one is not wasted
+	auto size = f_size + f_align;
+	if(size > m_blockSize / 2)
+	{
+		auto block = newBlock(size);
+		m_capacity += size;
+		block->Next = m_large;
+		m_large = block;
+
+		m_last = nullptr;
+		return alignUp(block->begin(), f_align);
+	}
+
+	// Move to the next regular block (reused after reset) or add one
+	if(m_block && m_block->Next)
+		m_block = m_block->Next;
+	else
+	{
+		auto block = newBlock(m_blockSize);
+		m_capacity += m_blockSize;
+		if(m_block)
+			m_block->Next = block;
+		else
+			m_blocks = block;
+		m_block = block;
+	}
+
+	p = alignUp(m_block->begin(), f_align);
+	m_pos = p + f_size;
+	m_end = m_block->end();
+	m_last = p;
+	return p;
+}
+
+
+void* CArena::reallocate(void* f_ptr, size_t f_oldSize, size_t f_newSize, size_t f_align)
+{
+	auto p = static_cast<uchar*>(f_ptr);
+	if(p && p == m_last && f_newSize <= static_cast<size_t>(m_end - p))
+	{
+		m_pos = p + f_newSize;
+		return p;
+	}
+
+	auto pNew = allocate(f_newSize, f_align);
+	if(f_oldSize)
+		memcpy(pNew, p, f_oldSize < f_newSize ? f_oldSize : f_newSize);
+	return pNew;
+}
+
+
+void CArena::reset()
+{
+	freeBlocks(m_large);
+	m_large = nullptr;
+
+	m_block = m_blocks;
+	m_pos = m_block ? m_block->begin() : nullptr;
+	m_end = m_block ? m_block->end() : nullptr;
+	m_last = nullptr;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+
+// Monotonic allocator: memory is released all at once by reset() or
+// destruction. Destructors of created objects are not called by the arena.
+class CArena
+{
+public:
+	explicit CArena(size_t f_blockSize = 4096);
+	~CArena();
+	CArena(const CArena&) = delete;
+	CArena& operator=(const CArena&) = delete;
+
+	void* allocate(size_t f_size, size_t f_align = alignof(std::max_align_t));
+	// Extends the latest allocation in place when possible, otherwise moves it
+	void* reallocate(void* f_ptr, size_t f_oldSize, size_t f_newSize, size_t f_align = alignof(std::max_align_t));
+
+	template<typename T, typename... T_Args>
+	T* create(T_Args&&... f_args)
+	{
+		return new(allocate(sizeof(T), alignof(T))) T(std::forward<T_Args>(f_args)...);
+	}
+
+	// Keeps regular blocks for reuse and frees dedicated (large) ones
+	void reset();
+
+	// Bytes requested from the heap
+	size_t capacity() const { return m_capacity; }
+
+private:
+	struct Block
+	{
+		Block*	Next;
+		size_t	Size;
+
+		uchar* begin() { return reinterpret_cast<uchar*>(this + 1); }
+		uchar* end() { return begin() + Size; }
+	};
+
+	static Block* newBlock(size_t f_size);
+	void freeBlocks(Block* f_block);
+
+private:
+	size_t	m_blockSize;
+
+	// Regular blocks (m_block is the current one) and dedicated blocks
+	Block*	m_blocks;
+	Block*	m_block;
+	Block*	m_large;
+
+	uchar*	m_pos;
+	uchar*	m_end;
+	// The latest allocation (for reallocate)
+	uchar*	m_last;
+
+	size_t	m_capacity;
+};
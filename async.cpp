@@ -0,0 +1,123 @@
+#include "async.h"
+
+#if defined(TAG_ASYNC)
+
+#include "common.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Reads block the threads: a few threads serve many coroutines as every
+// coroutine has at most one read queued
+class CThreadReactor : public Tag::IReactor
+{
+public:
+	explicit CThreadReactor(uint f_threads);
+	~CThreadReactor();
+
+	void post(std::coroutine_handle<> f_handle) final override { push(Job{-1, nullptr, 0, 0, nullptr, f_handle}); }
+	void read(int f_fd, void* f_buffer, size_t f_size, size_t f_offset, long& f_result, std::coroutine_handle<> f_handle) final override
+	{
+		push(Job{f_fd, f_buffer, f_size, f_offset, &f_result, f_handle});
+	}
+
+private:
+	struct Job
+	{
+		int						Fd;		// -1 to resume only
+		void*					Buffer;
+		size_t					Size;
+		size_t					Offset;
+		long*					Result;
+		std::coroutine_handle<>	Handle;
+	};
+
+	void push(const Job& f_job);
+	void run();
+
+private:
+	std::vector<std::thread>	m_threads;
+
+	std::mutex					m_mutex;
+	std::condition_variable		m_queued;
+	std::deque<Job>				m_queue;
+	bool						m_stop;
+};
+
+
+CThreadReactor::CThreadReactor(uint f_threads):
+	m_stop(false)
+{
+	for(uint i = 0; i < f_threads; ++i)
+		m_threads.emplace_back(&CThreadReactor::run, this);
+}
+
+
+CThreadReactor::~CThreadReactor()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_queued.notify_all();
+	for(auto& thread : m_threads)
+		thread.join();
+}
+
+
+void CThreadReactor::push(const Job& f_job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(f_job);
+	}
+	m_queued.notify_one();
+}
+
+
+void CThreadReactor::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for(;;)
+	{
+		m_queued.wait(lock, [this]{ return m_stop || !m_queue.empty(); });
+		// Pending jobs are dropped: their coroutines are never resumed
+		if(m_stop)
+			return;
+
+		auto job = m_queue.front();
+		m_queue.pop_front();
+		lock.unlock();
+
+		if(job.Fd != -1)
+		{
+			long n;
+			do
+				n = pread(job.Fd, job.Buffer, job.Size, job.Offset);
+			while(n == -1 && errno == EINTR);
+			*job.Result = (n == -1) ? -errno : n;
+		}
+		// Parsing runs here until the coroutine waits for its next read
+		job.Handle.resume();
+
+		lock.lock();
+	}
+}
+
+// ====================================
+namespace Tag
+{
+	std::shared_ptr<IReactor> IReactor::create(unsigned f_threads)
+	{
+		return std::make_shared<CThreadReactor>(std::max(1u, f_threads));
+	}
+
+	IReactor::~IReactor() {}
+}
+
+#endif
@@ -0,0 +1,265 @@
+#pragma once
+
+// Coroutine API (C++20): the tags of many files are located concurrently on a
+// few threads. The library itself stays C++11; the reactor is in tag_async.a.
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define TAG_ASYNC
+#endif
+#endif
+
+#if defined(TAG_ASYNC)
+
+#include "tag.h"
+
+#include <algorithm>
+#include <coroutine>
+#include <cstring> // memcpy
+#include <exception>
+#include <optional>
+#include <utility>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace Tag
+{
+	// Where coroutines wait for reads and are resumed. Reads of regular files
+	// are always "ready" for epoll, so the bundled reactor is a thread pool
+	// running pread; a reactor on io_uring or on a service's own event loop
+	// only needs these two calls.
+	class IReactor
+	{
+	public:
+		static std::shared_ptr<IReactor>	create	(unsigned f_threads = 4);
+
+	public:
+		// Resumes f_handle on a reactor thread
+		virtual void	post	(std::coroutine_handle<> f_handle)	= 0;
+		// Reads in the background, sets f_result (bytes read or -errno) and resumes f_handle
+		virtual void	read	(int f_fd, void* f_buffer, size_t f_size, size_t f_offset, long& f_result, std::coroutine_handle<> f_handle)	= 0;
+
+		virtual ~IReactor();
+	};
+
+
+	// A lazy coroutine: it starts when awaited and resumes the awaiting one
+	// when done (exceptions are passed on)
+	template<typename T>
+	class Task
+	{
+	public:
+		struct promise_type
+		{
+			std::optional<T>		m_value;
+			std::exception_ptr		m_error;
+			std::coroutine_handle<>	m_continuation;
+
+			Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+			std::suspend_always initial_suspend() noexcept { return {}; }
+			auto final_suspend() noexcept
+			{
+				struct Final
+				{
+					bool await_ready() noexcept { return false; }
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> f_handle) noexcept
+					{
+						auto continuation = f_handle.promise().m_continuation;
+						return continuation ? continuation : std::noop_coroutine();
+					}
+					void await_resume() noexcept {}
+				};
+				return Final{};
+			}
+			void return_value(T f_value) { m_value = std::move(f_value); }
+			void unhandled_exception() { m_error = std::current_exception(); }
+		};
+
+	public:
+		Task(Task&& f_task) noexcept: m_handle(std::exchange(f_task.m_handle, nullptr)) {}
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+		~Task()
+		{
+			if(m_handle)
+				m_handle.destroy();
+		}
+
+		bool await_ready() const noexcept { return false; }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> f_awaiting) noexcept
+		{
+			m_handle.promise().m_continuation = f_awaiting;
+			return m_handle;
+		}
+		T await_resume()
+		{
+			auto& promise = m_handle.promise();
+			if(promise.m_error)
+				std::rethrow_exception(promise.m_error);
+			return std::move(*promise.m_value);
+		}
+
+	private:
+		explicit Task(std::coroutine_handle<promise_type> f_handle): m_handle(f_handle) {}
+
+	private:
+		std::coroutine_handle<promise_type> m_handle;
+	};
+
+
+	namespace Detail
+	{
+		// Runs to the end on its own
+		struct Detached
+		{
+			struct promise_type
+			{
+				Detached get_return_object() { return {}; }
+				std::suspend_never initial_suspend() noexcept { return {}; }
+				std::suspend_never final_suspend() noexcept { return {}; }
+				void return_void() {}
+				void unhandled_exception() { std::terminate(); }
+			};
+		};
+
+		template<typename T, typename T_Fn>
+		Detached run(Task<T> f_task, T_Fn f_done)
+		{
+			f_done(co_await f_task);
+		}
+
+		struct Descriptor
+		{
+			int fd;
+			~Descriptor()
+			{
+				if(fd != -1)
+					close(fd);
+			}
+		};
+	}
+
+	// Starts f_task on the calling thread (up to its first read) and calls
+	// f_done with the result on the thread that completes it. f_done must not throw.
+	template<typename T, typename T_Fn>
+	void start(Task<T> f_task, T_Fn f_done)
+	{
+		Detail::run(std::move(f_task), std::move(f_done));
+	}
+
+	// co_await schedule(reactor): continues on a reactor thread
+	inline auto schedule(IReactor& f_reactor)
+	{
+		struct Awaiter
+		{
+			IReactor& reactor;
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> f_handle) { reactor.post(f_handle); }
+			void await_resume() const noexcept {}
+		};
+		return Awaiter{f_reactor};
+	}
+
+	// co_await readAt(...): bytes read or -errno
+	inline auto readAt(IReactor& f_reactor, int f_fd, void* f_buffer, size_t f_size, size_t f_offset)
+	{
+		struct Awaiter
+		{
+			IReactor&	reactor;
+			int			fd;
+			void*		buffer;
+			size_t		size;
+			size_t		offset;
+			long		result;
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> f_handle) { reactor.read(fd, buffer, size, offset, result, f_handle); }
+			long await_resume() const noexcept { return result; }
+		};
+		return Awaiter{f_reactor, f_fd, f_buffer, f_size, f_offset, 0};
+	}
+
+	// All f_size bytes (a file shrunk under us is an I/O error)
+	inline Task<bool> readAll(IReactor& f_reactor, int f_fd, unsigned char* f_buffer, size_t f_size, size_t f_offset)
+	{
+		while(f_size)
+		{
+			auto n = co_await readAt(f_reactor, f_fd, f_buffer, f_size, f_offset);
+			if(n <= 0)
+				co_return false;
+			f_buffer += n;
+			f_offset += n;
+			f_size -= n;
+		}
+		co_return true;
+	}
+
+
+	struct FileResult
+	{
+		Status					status;
+		std::shared_ptr<IFile>	file;	// nullptr on error
+	};
+
+	// IFile::create (AccessRead) with the reads awaited: the coroutine waits
+	// on the reactor instead of blocking a thread
+	inline Task<FileResult> createFileAsync(IReactor& f_reactor, std::string f_path)
+	{
+		co_await schedule(f_reactor);
+
+		FileResult result{Status{Status::ErrIO, 0}, nullptr};
+		Detail::Descriptor fd{::open(f_path.c_str(), O_RDONLY | O_CLOEXEC)};
+		struct stat st;
+		if(fd.fd == -1 || fstat(fd.fd, &st) == -1)
+			co_return result;
+		size_t size = st.st_size;
+		auto loader = IFileLoader::create(size);
+
+		// Head: the window, then the rest of the ID3v2 tag
+		std::vector<unsigned char> head(loader->getHeadWindow());
+		if(!co_await readAll(f_reactor, fd.fd, head.data(), head.size(), 0))
+			co_return result;
+		auto window = head.size();
+		head.resize(std::max(window, loader->getHeadSize(head.data())));
+		if(!co_await readAll(f_reactor, fd.fd, head.data() + window, head.size() - window, window))
+			co_return result;
+		result.status = loader->loadHead(head.data());
+		if(!result.status.ok())
+			co_return result;
+
+		// Tail: [begin, size) grows backwards; the part the head has is not read again
+		std::vector<unsigned char> tail;
+		size_t begin = size;
+		for(auto offset = loader->getTailOffset();;)
+		{
+			if(offset < begin)
+			{
+				tail.insert(tail.begin(), begin - offset, 0);
+
+				// The head may hold the start of the gap already
+				if(offset < head.size())
+					memcpy(tail.data(), head.data() + offset, std::min(begin, head.size()) - offset);
+				auto from = std::max(offset, head.size());
+				if(from < begin && !co_await readAll(f_reactor, fd.fd, tail.data() + (from - offset), begin - from, from))
+				{
+					result.status = Status{Status::ErrIO, offset};
+					co_return result;
+				}
+				begin = offset;
+			}
+
+			auto next = loader->loadTail(tail.data() + (offset - begin), offset, result.status);
+			if(next == offset)
+				break;
+			offset = next;
+		}
+
+		if(result.status.ok())
+			result.file = loader->getFile(std::min(size, head.size() + tail.size()));
+		co_return result;
+	}
+}
+
+#endif
@@ -0,0 +1,505 @@
+#include "extents.h"
+#include "file.h"
+#include "ioqueue.h"
+
+#include <algorithm>
+#include <cstring> // memcpy
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+using Tag::Status;
+
+
+// A file being located: the same steps as CFile::load with the reads
+// queued instead of blocking (the head and the first tail window are read
+// at the same time)
+struct Job
+{
+	size_t					Index;
+	int						Fd;
+	std::shared_ptr<CFile>	File;
+	Status					Result;
+	bool					Failed;
+
+	// [0, Head.size()), sized from the ID3v2 header after the first read
+	std::vector<uchar>		Head;
+	bool					HeadSized;
+	bool					HeadLoaded;
+
+	// [TailBegin, the end of the file)
+	std::vector<uchar>		Tail;
+	size_t					TailBegin;
+	// The offset for CFile::loadTail
+	size_t					TailOffset;
+
+	// One read at a time for each window
+	CIOQueue::Request		HeadRead;
+	CIOQueue::Request		TailRead;
+	bool					HeadReading;
+	bool					TailReading;
+	size_t					BytesRead;
+
+	// For the seek statistics: [offset, size) as issued
+	CExtentMap				Extents;
+	std::vector<std::pair<size_t, size_t>>	Reads;
+};
+
+
+// A file to be started (mapped ahead when ordering)
+struct Planned
+{
+	size_t		Index;
+	int			Fd;	// -1 if it could not be opened
+	CExtentMap	Extents;
+};
+
+
+// The reads of a file as seen by the disk
+struct Track
+{
+	size_t		Reads;
+	size_t		Seeks;
+	uint64_t	First;
+	uint64_t	Last;	// Past the end of the last read
+	bool		FirstKnown;
+	bool		LastKnown;
+};
+
+
+class CBatch : public Tag::IBatch
+{
+public:
+	CBatch(uint f_depth, Order f_order);
+
+	bool isIOUring() const final override { return m_queue->isIOUring(); }
+
+	void scan(const std::vector<std::string>& f_paths, const Callback& f_callback) final override;
+	Stats getStats() const final override { return m_stats; }
+	void setLimits(const Tag::Limits& f_limits) final override { m_limits = f_limits; }
+
+private:
+	// The files are opened, mapped and sorted a window at a time (they stay
+	// open until started, so the window is well below the descriptor limit)
+	enum { PlanWindow = 256 };
+	// A short skip forward is not a seek: the disk reads through it (the
+	// files of a directory are a few blocks apart)
+	enum { SeekGap = 128 * 1024 };
+
+	static bool isSeek(uint64_t f_end, uint64_t f_start) { return f_start < f_end || f_start - f_end > SeekGap; }
+
+	// The next window of f_paths from f_ioNext, in the order to be started
+	void plan(const std::vector<std::string>& f_paths, size_t& f_ioNext, std::vector<Planned>& f_planned);
+	// Takes over the descriptor
+	std::unique_ptr<Job> start(const Planned& f_planned, Status& f_status);
+	void read(Job& f_job, CIOQueue::Request& f_request, uchar* f_buffer, size_t f_offset, size_t f_size);
+	// Returns true when the job is finished
+	bool complete(Job& f_job, CIOQueue::Request& f_request);
+	bool process(Job& f_job);
+	void fail(Job& f_job, const Status& f_status);
+	static Track track(const Job& f_job);
+	// Seeks between the files taken in f_order (the reads of each file together)
+	static size_t countSeeks(const std::vector<Track>& f_tracks, const std::vector<size_t>& f_order);
+
+	// Waits for the reads in flight (the buffers must outlive them)
+	void drain();
+
+private:
+	Order						m_order;
+	Tag::Limits					m_limits;
+	std::unique_ptr<CIOQueue>	m_queue;
+	// Every job has two reads at most
+	uint						m_maxJobs;
+	uint						m_pending;
+	std::vector<CIOQueue::Request*>	m_completed;
+	Stats						m_stats;
+};
+
+
+CBatch::CBatch(uint f_depth, Order f_order):
+	m_order(f_order),
+	m_limits(Tag::Limits::none()),
+	m_maxJobs(std::max(1u, f_depth / 2)),
+	m_pending(0),
+	m_stats{0, 0, 0}
+{
+	m_queue = CIOQueue::create(2 * m_maxJobs);
+}
+
+
+void CBatch::scan(const std::vector<std::string>& f_paths, const Callback& f_callback)
+{
+	std::vector<std::unique_ptr<Job>> jobs;
+	std::vector<Planned> planned;
+	size_t next = 0;
+	size_t nextPlanned = 0;
+
+	m_stats = Stats{0, 0, 0};
+	std::vector<Track> tracks;
+	std::vector<size_t> started;
+	if(m_order == OrderPhysical)
+	{
+		tracks.resize(f_paths.size(), Track{0, 0, 0, 0, false, false});
+		started.reserve(f_paths.size());
+	}
+
+	auto finish = [&](Job& f_job)
+	{
+		close(f_job.Fd);
+		f_job.Fd = -1;
+		m_stats.reads += f_job.Reads.size();
+		if(!tracks.empty())
+			tracks[f_job.Index] = track(f_job);
+		f_job.File->setBytesRead(f_job.BytesRead);
+		std::shared_ptr<Tag::IFile> file;
+		if(f_job.Result.ok())
+			file = f_job.File;
+		f_callback(f_job.Index, f_job.Result, file);
+	};
+
+	try
+	{
+		while(next < f_paths.size() || nextPlanned < planned.size() || m_pending)
+		{
+			while(jobs.size() < m_maxJobs)
+			{
+				if(nextPlanned == planned.size())
+				{
+					if(next == f_paths.size())
+						break;
+					plan(f_paths, next, planned);
+					nextPlanned = 0;
+				}
+
+				Status status;
+				auto& file = planned[nextPlanned++];
+				if(!tracks.empty())
+					started.push_back(file.Index);
+				auto job = start(file, status);
+				if(!job)
+					f_callback(file.Index, status, nullptr);
+				else if(process(*job))
+					finish(*job);
+				else
+					jobs.push_back(std::move(job));
+			}
+			if(!m_pending)
+				continue;
+
+			m_completed.clear();
+			m_queue->wait(m_completed);
+			m_pending -= m_completed.size();
+
+			for(auto request : m_completed)
+			{
+				auto& job = *static_cast<Job*>(request->User);
+				if(!complete(job, *request))
+					continue;
+
+				auto it = std::find_if(jobs.begin(), jobs.end(), [&job](const std::unique_ptr<Job>& f_job){ return f_job.get() == &job; });
+				auto done = std::move(*it);
+				jobs.erase(it);
+				finish(*done);
+			}
+		}
+	}
+	catch(...)
+	{
+		drain();
+		for(; nextPlanned < planned.size(); ++nextPlanned)
+		{
+			if(planned[nextPlanned].Fd != -1)
+				close(planned[nextPlanned].Fd);
+		}
+		for(auto& job : jobs)
+		{
+			if(job->Fd != -1)
+				close(job->Fd);
+		}
+		throw;
+	}
+
+	if(!tracks.empty())
+	{
+		std::vector<size_t> given(f_paths.size());
+		for(size_t i = 0; i < given.size(); ++i)
+			given[i] = i;
+		m_stats.seeks = countSeeks(tracks, started);
+		m_stats.seeksGiven = countSeeks(tracks, given);
+	}
+}
+
+
+void CBatch::plan(const std::vector<std::string>& f_paths, size_t& f_ioNext, std::vector<Planned>& f_planned)
+{
+	auto end = std::min<size_t>(f_paths.size(), f_ioNext + PlanWindow);
+	f_planned.resize(end - f_ioNext);
+	for(auto& file : f_planned)
+	{
+		// Opening is synchronous: it is cheap next to the reads and IORING_OP_OPENAT
+		// is newer than IORING_OP_READ
+		file.Index = f_ioNext++;
+		file.Fd = ::open(f_paths[file.Index].c_str(), O_RDONLY | O_CLOEXEC);
+		file.Extents = CExtentMap();
+		if(file.Fd != -1 && m_order == OrderPhysical)
+			file.Extents.load(file.Fd);
+	}
+
+	if(m_order != OrderPhysical)
+		return;
+	// Mapped files first on each device, by their first block; inode
+	// numbers follow the block groups on most file systems
+	std::stable_sort(f_planned.begin(), f_planned.end(), [](const Planned& f_a, const Planned& f_b)
+	{
+		auto& a = f_a.Extents;
+		auto& b = f_b.Extents;
+		if(a.getDevice() != b.getDevice())
+			return a.getDevice() < b.getDevice();
+		if(a.isMapped() != b.isMapped())
+			return a.isMapped();
+		return a.getKey() < b.getKey();
+	});
+}
+
+
+std::unique_ptr<Job> CBatch::start(const Planned& f_planned, Status& f_status)
+{
+	auto fd = f_planned.Fd;
+	if(fd == -1)
+	{
+		f_status = Status{Status::ErrIO, 0};
+		return nullptr;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == -1)
+	{
+		close(fd);
+		f_status = Status{Status::ErrIO, 0};
+		return nullptr;
+	}
+
+	std::unique_ptr<Job> job(new Job());
+	job->Index = f_planned.Index;
+	job->Fd = fd;
+	job->File = std::make_shared<CFile>(st.st_size, m_limits);
+	job->Result = Status{Status::ErrNone, 0};
+	job->Failed = false;
+	job->HeadSized = false;
+	job->HeadLoaded = false;
+	job->HeadReading = false;
+	job->TailReading = false;
+	job->BytesRead = 0;
+	job->Extents = f_planned.Extents;
+
+	size_t size = st.st_size;
+	auto headSize = std::min<size_t>(size, CFile::HeadWindow);
+	job->Head.resize(headSize);
+	read(*job, job->HeadRead, job->Head.data(), 0, headSize);
+
+	// Past the head window: small files are read once
+	job->TailBegin = std::max(headSize, size - std::min<size_t>(size, CFile::TailWindow));
+	job->TailOffset = job->TailBegin;
+	job->Tail.resize(size - job->TailBegin);
+	read(*job, job->TailRead, job->Tail.data(), job->TailBegin, job->Tail.size());
+
+	return job;
+}
+
+
+void CBatch::read(Job& f_job, CIOQueue::Request& f_request, uchar* f_buffer, size_t f_offset, size_t f_size)
+{
+	if(!f_size)
+		return;
+
+	f_request.Fd = f_job.Fd;
+	f_request.Buffer = f_buffer;
+	f_request.Size = f_size;
+	f_request.Offset = f_offset;
+	f_request.User = &f_job;
+	f_request.Result = 0;
+	f_job.Reads.push_back(std::make_pair(f_offset, f_size));
+
+	m_queue->submit(&f_request);
+	(&f_request == &f_job.HeadRead ? f_job.HeadReading : f_job.TailReading) = true;
+	++m_pending;
+}
+
+
+bool CBatch::complete(Job& f_job, CIOQueue::Request& f_request)
+{
+	(&f_request == &f_job.HeadRead ? f_job.HeadReading : f_job.TailReading) = false;
+	if(f_job.Failed)
+		return process(f_job);
+
+	// A file shrunk under us is an I/O error as well
+	if(f_request.Result <= 0)
+	{
+		fail(f_job, Status{Status::ErrIO, f_request.Offset});
+		return process(f_job);
+	}
+
+	size_t n = f_request.Result;
+	f_job.BytesRead += n;
+	if(n < f_request.Size)
+	{
+		read(f_job, f_request, f_request.Buffer + n, f_request.Offset + n, f_request.Size - n);
+		return false;
+	}
+	return process(f_job);
+}
+
+
+bool CBatch::process(Job& f_job)
+{
+	auto& file = *f_job.File;
+
+	// The buffers must outlive the reads
+	if(f_job.Failed)
+		return !f_job.HeadReading && !f_job.TailReading;
+
+	if(!f_job.HeadLoaded)
+	{
+		if(f_job.HeadReading)
+			return false;
+
+		if(!f_job.HeadSized)
+		{
+			f_job.HeadSized = true;
+			auto window = f_job.Head.size();
+			auto size = file.getHeadSize(f_job.Head.data());
+			if(size > window)
+			{
+				// Up to the first tail window, which has the rest
+				f_job.Head.resize(size);
+				auto end = std::min(size, f_job.TailBegin);
+				read(f_job, f_job.HeadRead, &f_job.Head[window], window, end - window);
+				if(f_job.HeadReading)
+					return false;
+			}
+		}
+
+		if(f_job.Head.size() > f_job.TailBegin)
+		{
+			if(f_job.TailReading)
+				return false;
+			memcpy(&f_job.Head[f_job.TailBegin], f_job.Tail.data(), f_job.Head.size() - f_job.TailBegin);
+		}
+
+		auto status = file.loadHead(f_job.Head.data());
+		if(!status.ok())
+		{
+			fail(f_job, status);
+			return !f_job.TailReading;
+		}
+		f_job.HeadLoaded = true;
+		f_job.TailOffset = file.getTailOffset();
+	}
+
+	for(;;)
+	{
+		if(f_job.TailReading)
+			return false;
+
+		if(f_job.TailOffset < f_job.TailBegin)
+		{
+			auto begin = f_job.TailOffset;
+			f_job.Tail.insert(f_job.Tail.begin(), f_job.TailBegin - begin, 0);
+
+			// The head window may hold the start of the gap already
+			auto headSize = f_job.Head.size();
+			if(begin < headSize)
+				memcpy(f_job.Tail.data(), &f_job.Head[begin], std::min(f_job.TailBegin, headSize) - begin);
+			auto from = std::max(begin, headSize);
+			if(from < f_job.TailBegin)
+				read(f_job, f_job.TailRead, &f_job.Tail[from - begin], from, f_job.TailBegin - from);
+			f_job.TailBegin = begin;
+			continue;
+		}
+
+		Status status;
+		auto next = file.loadTail(f_job.Tail.data() + (f_job.TailOffset - f_job.TailBegin), f_job.TailOffset, status);
+		if(next == f_job.TailOffset)
+		{
+			f_job.Result = status;
+			return true;
+		}
+		f_job.TailOffset = next;
+	}
+}
+
+
+void CBatch::fail(Job& f_job, const Status& f_status)
+{
+	f_job.Failed = true;
+	f_job.Result = f_status;
+}
+
+
+Track CBatch::track(const Job& f_job)
+{
+	Track track{f_job.Reads.size(), 0, 0, 0, false, false};
+	bool known = false;
+	uint64_t end = 0;
+	for(size_t i = 0; i < f_job.Reads.size(); ++i)
+	{
+		auto& read = f_job.Reads[i];
+		uint64_t physical;
+		bool mapped = f_job.Extents.getPhysical(read.first, physical);
+		if(!i)
+		{
+			track.First = physical;
+			track.FirstKnown = mapped;
+		}
+		else if(known && mapped && isSeek(end, physical))
+			++track.Seeks;
+		known = mapped;
+		end = physical + read.second;
+	}
+	track.Last = end;
+	track.LastKnown = known;
+	return track;
+}
+
+
+size_t CBatch::countSeeks(const std::vector<Track>& f_tracks, const std::vector<size_t>& f_order)
+{
+	size_t seeks = 0;
+	bool known = false;
+	uint64_t end = 0;
+	for(auto index : f_order)
+	{
+		auto& track = f_tracks[index];
+		if(!track.Reads)
+			continue;
+		if(known && track.FirstKnown && isSeek(end, track.First))
+			++seeks;
+		seeks += track.Seeks;
+		known = track.LastKnown;
+		end = track.Last;
+	}
+	return seeks;
+}
+
+
+void CBatch::drain()
+{
+	while(m_pending)
+	{
+		m_completed.clear();
+		m_queue->wait(m_completed);
+		m_pending -= m_completed.size();
+	}
+}
+
+// ====================================
+namespace Tag
+{
+	std::shared_ptr<IBatch> IBatch::create(unsigned f_depth, Order f_order)
+	{
+		return std::make_shared<CBatch>(f_depth, f_order);
+	}
+
+	IBatch::~IBatch() {}
+}
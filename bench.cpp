@@ -0,0 +1,396 @@
+#include "common.h"
+
+#include "tag.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+#define LOG(msg)	std::cout << msg << std::endl
+
+
+// Synthetic tags (no test files required)
+static void appendFrame(std::vector<uchar>& f_tag, const char* f_id, const std::string& f_payload)
+{
+	f_tag.insert(f_tag.end(), f_id, f_id + 4);
+	auto size = f_payload.size();
+	for(int shift = 24; shift >= 0; shift -= 8)
+		f_tag.push_back((size >> shift) & 0xFF);
+	f_tag.push_back(0);
+	f_tag.push_back(0);
+	f_tag.insert(f_tag.end(), f_payload.begin(), f_payload.end());
+}
+
+static std::vector<uchar> makeTag(size_t f_paddingSize, size_t f_pictureSize = 0)
+{
+	std::vector<uchar> frames;
+	if(f_pictureSize)
+		appendFrame(frames, "APIC", std::string("\0image/jpeg\0\3\0", 14) + std::string(f_pictureSize, 'p'));
+	appendFrame(frames, "TIT2", std::string("\0Some Title", 11));
+	appendFrame(frames, "TPE1", std::string("\0Some Artist", 12));
+	appendFrame(frames, "TALB", std::string("\0Some Album", 11));
+	appendFrame(frames, "TRCK", std::string("\0" "3/12", 5));
+	appendFrame(frames, "TYER", std::string("\0" "1999", 5));
+	appendFrame(frames, "TCON", std::string("\0(17)Rock", 9));
+	appendFrame(frames, "COMM", std::string("\0eng\0A comment", 14));
+	appendFrame(frames, "TENC", std::string("\0Encoder", 8));
+	appendFrame(frames, "PRIV", std::string("owner\0data", 10));
+	frames.resize(frames.size() + f_paddingSize);
+
+	auto size = frames.size();
+	uchar header[] = { 'I', 'D', '3', 3, 0, 0,
+					   uchar((size >> 21) & 0x7F), uchar((size >> 14) & 0x7F),
+					   uchar((size >>  7) & 0x7F), uchar( size        & 0x7F) };
+	frames.insert(frames.begin(), header, header + sizeof(header));
+	return frames;
+}
+
+// Lyrics3v2 with a single LYR field (f_size <= 99999)
+static std::string makeLyrics(size_t f_size)
+{
+	auto size = std::to_string(f_size);
+	auto tag = "LYRICSBEGINLYR" + std::string(5 - size.size(), '0') + size + std::string(f_size, 'a');
+	size = std::to_string(tag.size());
+	return tag + std::string(6 - size.size(), '0') + size + "LYRICS200";
+}
+
+// ================
+template<typename T_Fn>
+static void measure(const char* f_name, unsigned f_iterations, T_Fn f_fn)
+{
+	auto start = std::chrono::steady_clock::now();
+	for(unsigned i = 0; i < f_iterations; ++i)
+		f_fn();
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+	LOG(f_name << ": " << double(ns) / f_iterations << " ns/op");
+}
+
+static volatile size_t s_sink;
+
+static void benchAccessors()
+{
+	auto buf = makeTag(1024);
+	auto tag = Tag::IID3v2::create(&buf[0], 0, buf.size());
+	const unsigned n = 10000000;
+
+	LOG("Accessors" << std::endl << "================");
+	measure("getTitleCount  ", n, [&]{ s_sink += tag->getTitleCount(); });
+	measure("getTitle(0)    ", n, [&]{ s_sink += tag->getTitle(0).size(); });
+	measure("getGenreIndex  ", n, [&]{ s_sink += tag->getGenreIndex(0); });
+	measure("getComment(0)  ", n, [&]{ s_sink += tag->getComment(0).size(); });
+	measure("getPictureCount", n, [&]{ s_sink += tag->getPictureCount(); });
+}
+
+static void benchParse()
+{
+	auto buf = makeTag(1024);
+	const unsigned n = 1000000;
+
+	LOG("Parsing" << std::endl << "================");
+	measure("create         ", n, [&]{ s_sink += Tag::IID3v2::create(&buf[0], 0, buf.size())->getSize(); });
+	measure("createBorrowed ", n, [&]{ s_sink += Tag::IID3v2::createBorrowed(&buf[0], 0, buf.size())->getSize(); });
+	measure("create + title ", n, [&]{ s_sink += Tag::IID3v2::createBorrowed(&buf[0], 0, buf.size())->getTitle(0).size(); });
+	auto fields = Tag::IID3v2::FieldTitle | Tag::IID3v2::FieldArtist | Tag::IID3v2::FieldAlbum | Tag::IID3v2::FieldTrack;
+	measure("create (4 only)", n, [&]{ s_sink += Tag::IID3v2::createBorrowed(&buf[0], 0, buf.size(), fields)->getSize(); });
+
+	auto parser = Tag::IParser::create();
+	measure("parser         ", n, [&]{ s_sink += parser->parseID3v2(&buf[0], 0, buf.size()).getSize(); });
+	measure("parser + title ", n, [&]{ s_sink += parser->parseID3v2(&buf[0], 0, buf.size()).getTitle(0).size(); });
+	measure("parser (4 only)", n, [&]{ s_sink += parser->parseID3v2(&buf[0], 0, buf.size(), fields).getSize(); });
+
+	// The checks of typical limits (none is hit)
+	auto limited = Tag::IParser::create();
+	limited->setLimits(Tag::Limits{1 << 20, 256 * 1024, 256, 4096});
+	measure("parser (limits)", n, [&]{ s_sink += limited->parseID3v2(&buf[0], 0, buf.size()).getSize(); });
+}
+
+
+static void benchSerialize()
+{
+	auto buf = makeTag(64 * 1024);
+	auto tag = Tag::IID3v2::create(&buf[0], 0, buf.size());
+	std::vector<uchar> out;
+	out.reserve(buf.size());
+	const unsigned n = 100000;
+
+	LOG("Serializing (64 KB)" << std::endl << "================");
+	measure("memcpy         ", n, [&]{ out.assign(buf.begin(), buf.end()); s_sink += out.size(); });
+	measure("unmodified     ", n, [&]{ out.clear(); tag->serialize(out); s_sink += out.size(); });
+	// One frame encoded, the rest copied
+	tag->setTitle(0, "Another Title");
+	measure("1 title set    ", n, [&]{ out.clear(); tag->serialize(out); s_sink += out.size(); });
+}
+
+
+// A title set in a tag with a 1 MB picture, written to a file
+static void benchGather()
+{
+	auto buf = makeTag(4096, 1 << 20);
+	auto tag = Tag::IID3v2::create(&buf[0], 0, buf.size());
+	tag->setTitle(0, "Another Title");
+	char path[] = "/tmp/tag-bench-XXXXXX";
+	auto fd = mkstemp(path);
+	if(fd == -1)
+		return;
+	std::vector<uchar> out;
+	Tag::GatherList list;
+	const unsigned n = 2000;
+
+	LOG("Writing a tag (1 MB picture)" << std::endl << "================");
+	measure("vector + pwrite", n, [&]{ out.clear(); tag->serialize(out); s_sink += pwrite(fd, &out[0], out.size(), 0); });
+	measure("pwritev        ", n, [&]{ list.clear(); tag->serialize(list); s_sink += list.write(fd, 0); });
+
+	close(fd);
+	unlink(path);
+}
+
+
+static void benchSave()
+{
+	// 16 MB of audio after the tag
+	char path[] = "/tmp/tag-bench-XXXXXX";
+	auto fd = mkstemp(path);
+	if(fd == -1)
+		return;
+	auto writeFile = [&](size_t f_paddingSize)
+	{
+		auto buf = makeTag(f_paddingSize);
+		std::vector<uchar> audio(16 * 1024 * 1024);
+		s_sink += pwrite(fd, &buf[0], buf.size(), 0);
+		s_sink += pwrite(fd, &audio[0], audio.size(), buf.size());
+		s_sink += ftruncate(fd, buf.size() + audio.size());
+		return buf;
+	};
+	Tag::Status status{Tag::Status::ErrNone, 0};
+
+	LOG("Saving (16 MB file)" << std::endl << "================");
+	auto buf = writeFile(4096);
+	auto tag = Tag::IID3v2::create(&buf[0], 0, buf.size());
+	unsigned i = 0;
+	measure("in place       ", 1000, [&]{ tag->setTitle(0, (i++ & 1) ? "Title A" : "Title B"); s_sink += Tag::saveID3v2(path, *tag, status); });
+
+	// No padding: every longer title moves the audio
+	buf = writeFile(0);
+	tag = Tag::IID3v2::create(&buf[0], 0, buf.size());
+	auto none = Tag::IPaddingPolicy::createFixed(0);
+	std::string title;
+	measure("rewrite        ", 20, [&]{ title += 'a'; tag->setTitle(0, title); s_sink += Tag::saveID3v2(path, *tag, *none, status); });
+	// The trailing tags (none here) dropped, the audio moved
+	measure("strip          ", 20, [&]{ s_sink += Tag::rewriteFile(path, Tag::KeepNone).ok(); });
+
+	close(fd);
+	unlink(path);
+}
+
+
+// Repeated edits of a library through each policy: the share of the saves
+// done in place and the padding left in the files
+static void benchPaddingPolicy(const char* f_workload, size_t f_lyrics)
+{
+	struct Edit
+	{
+		size_t	File;
+		long	Growth;
+	};
+	const size_t files = 10000;
+	std::mt19937 random(1);
+	std::vector<size_t> frames(files);
+	for(auto& size : frames)
+		size = 300 + random() % 2000;
+	// Retyped text; f_lyrics% of the edits add lyrics, 1% a picture
+	std::vector<Edit> edits(files * 10);
+	for(auto& edit : edits)
+	{
+		edit.File = random() % files;
+		auto kind = random() % 100;
+		if(kind < f_lyrics)
+			edit.Growth = 1024 + random() % 7168;
+		else if(kind < f_lyrics + 1)
+			edit.Growth = 20 * 1024 + random() % (180 * 1024);
+		else
+			edit.Growth = long(random() % 129) - 64;
+	}
+
+	LOG("Padding policies: " << f_workload << " (" << edits.size() << " edits of " << files << " files)" << std::endl << "================");
+	auto simulate = [&](const char* f_name, Tag::IPaddingPolicy& f_policy)
+	{
+		// The files start without padding
+		auto size = frames;
+		auto slot = frames;
+		size_t inPlace = 0;
+		auto start = std::chrono::steady_clock::now();
+		for(auto& edit : edits)
+		{
+			auto before = size[edit.File];
+			auto& after = size[edit.File];
+			after = std::max<long>(100, long(after) + edit.Growth);
+			f_policy.onEdit(before, after);
+			if(after <= slot[edit.File])
+				++inPlace;
+			else
+				slot[edit.File] = f_policy.getTagSize(after);
+		}
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+		size_t padding = 0;
+		for(size_t i = 0; i < files; ++i)
+			padding += slot[i] - size[i];
+		LOG(f_name << ": " << 100.0 * inPlace / edits.size() << "% in place, " << padding / files << " bytes of padding per file, " << double(ns) / edits.size() << " ns/edit");
+	};
+	simulate("none           ", *Tag::IPaddingPolicy::createFixed(0));
+	simulate("fixed 4 KB     ", *Tag::IPaddingPolicy::createFixed());
+	simulate("10%, >= 1 KB   ", *Tag::IPaddingPolicy::createProportional());
+	simulate("4 KB blocks    ", *Tag::IPaddingPolicy::createBlock());
+	simulate("learned        ", *Tag::IPaddingPolicy::createLearned());
+}
+
+static void benchPadding()
+{
+	auto buf = makeTag(256 * 1024);
+	auto parser = Tag::IParser::create();
+	const unsigned n = 20000;
+
+	LOG("Structure scan (256 KB of padding)" << std::endl << "================");
+	auto start = std::chrono::steady_clock::now();
+	measure("parser         ", n, [&]{ s_sink += parser->parseID3v2(&buf[0], 0, buf.size()).getSize(); });
+	auto s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	LOG("throughput     : " << buf.size() * double(n) / s / (1 << 30) << " GB/s");
+}
+
+
+static void benchLyrics()
+{
+	auto tag = makeLyrics(99999);
+	auto pData = reinterpret_cast<const uchar*>(tag.data());
+	// Followed by an ID3v1 tag: the size field is not at the end of the data
+	auto buf = tag + std::string(128, '\0');
+	auto pBuf = reinterpret_cast<const uchar*>(buf.data());
+	const unsigned n = 100000;
+
+	LOG("Lyrics3v2 (100 KB)" << std::endl << "================");
+	measure("getSize (exact)", n, [&]{ s_sink += Tag::ILyrics::getSize(pData, 0, tag.size()); });
+	measure("getSize        ", n, [&]{ s_sink += Tag::ILyrics::getSize(pBuf, 0, buf.size()); });
+}
+
+
+// Drops the files from the page cache (they must be on a disk)
+static void evict(const std::vector<std::string>& f_paths)
+{
+	for(auto& path : f_paths)
+	{
+		auto fd = open(path.c_str(), O_RDONLY);
+		if(fd == -1)
+			continue;
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void benchBatchCold(const char* f_dir, std::vector<std::string> f_paths)
+{
+	// Listed as a directory would list them: not in the order they were written
+	std::shuffle(f_paths.begin(), f_paths.end(), std::mt19937(1));
+	const unsigned n = 10;
+
+	LOG("");
+	LOG("Locating 256 files (not cached, " << f_dir << ")" << std::endl << "================");
+	for(auto order : { Tag::IBatch::OrderGiven, Tag::IBatch::OrderPhysical })
+	{
+		auto batch = Tag::IBatch::create(256, order);
+		double ns = 0;
+		for(unsigned i = 0; i < n; ++i)
+		{
+			evict(f_paths);
+			auto start = std::chrono::steady_clock::now();
+			batch->scan(f_paths, [](size_t, const Tag::Status& f_status, const std::shared_ptr<Tag::IFile>& f_file){ s_sink += f_status.ok() ? f_file->getAudioEnd() : 0; });
+			ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+		LOG((order == Tag::IBatch::OrderGiven ? "IBatch (given)  " : "IBatch (blocks) ") << ": " << ns / n << " ns/op");
+		if(order == Tag::IBatch::OrderPhysical)
+		{
+			auto stats = batch->getStats();
+			LOG("seeks          : " << stats.seeks << " of " << stats.reads << " reads, " <<
+				stats.seeksGiven - std::min(stats.seeks, stats.seeksGiven) << " avoided");
+		}
+	}
+}
+
+static void benchBatch()
+{
+	// Temporary files: an ID3v2 tag, 64 KB of audio and an ID3v1 tag
+	char dir[] = "/tmp/tag-bench-XXXXXX";
+	if(!mkdtemp(dir))
+		return;
+	auto tag = makeTag(1024);
+	tag.resize(tag.size() + 64 * 1024);
+	tag.insert(tag.end(), {'T', 'A', 'G'});
+	tag.resize(tag.size() + 125);
+
+	std::vector<std::string> paths;
+	for(unsigned i = 0; i < 256; ++i)
+	{
+		paths.push_back(std::string(dir) + "/" + std::to_string(i) + ".mp3");
+		auto f = fopen(paths.back().c_str(), "wb");
+		fwrite(&tag[0], 1, tag.size(), f);
+		// Allocated now, in this order (not on the first eviction)
+		fflush(f);
+		fsync(fileno(f));
+		fclose(f);
+	}
+	auto batch = Tag::IBatch::create(256, Tag::IBatch::OrderGiven);
+	auto sorted = Tag::IBatch::create(256, Tag::IBatch::OrderPhysical);
+	const unsigned n = 100;
+
+	LOG("Locating 256 files (cached)" << std::endl << "================");
+	measure("IFile::create  ", n, [&]{ for(auto& path : paths) s_sink += Tag::IFile::create(path)->getAudioEnd(); });
+	measure(batch->isIOUring() ? "IBatch (uring) " : "IBatch (thread)", n, [&]
+	{
+		batch->scan(paths, [](size_t, const Tag::Status& f_status, const std::shared_ptr<Tag::IFile>& f_file){ s_sink += f_status.ok() ? f_file->getAudioEnd() : 0; });
+	});
+	// The cost of mapping the files
+	measure("IBatch (blocks)", n, [&]
+	{
+		sorted->scan(paths, [](size_t, const Tag::Status& f_status, const std::shared_ptr<Tag::IFile>& f_file){ s_sink += f_status.ok() ? f_file->getAudioEnd() : 0; });
+	});
+
+	benchBatchCold(dir, paths);
+
+	for(auto& path : paths)
+		unlink(path.c_str());
+	rmdir(dir);
+}
+
+
+int main(int, char**)
+{
+	benchAccessors();
+	LOG("");
+	benchParse();
+	LOG("");
+	benchSerialize();
+	LOG("");
+	benchGather();
+	LOG("");
+	benchSave();
+	LOG("");
+	benchPaddingPolicy("retagging", 0);
+	LOG("");
+	benchPaddingPolicy("adding lyrics", 20);
+	LOG("");
+	benchPadding();
+	LOG("");
+	benchLyrics();
+	LOG("");
+	benchBatch();
+
+	return 0;
+}
@@ -0,0 +1,690 @@
+#include "common.h"
+
+#include "tag.h"
+#include "async.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Round-trip checks on synthetic tags and files ("make check"): no test
+// files are required and the exit code is the number of failures
+#define LOG(msg)	std::cout << msg << std::endl
+
+static unsigned s_failures = 0;
+
+#define CHECK(X)	do { if(!(X)) { ++s_failures; std::cerr << "FAILED @ " << __FILE__ << ":" << __LINE__ << ": " #X << std::endl; } } while(0)
+
+using Bytes = std::vector<uchar>;
+
+
+// ================
+// Files in a temporary directory removed at the end
+class CTempDir
+{
+public:
+	CTempDir(): m_path("/tmp/id3_check.XXXXXX") { ASSERT(mkdtemp(&m_path[0])); }
+	~CTempDir()
+	{
+		for(auto& name : m_files)
+			unlink(name.c_str());
+		rmdir(m_path.c_str());
+	}
+
+	std::string create(const std::string& f_name, const Bytes& f_data)
+	{
+		auto path = m_path + "/" + f_name;
+		auto file = fopen(path.c_str(), "wb");
+		ASSERT(file);
+		ASSERT(f_data.empty() || fwrite(f_data.data(), 1, f_data.size(), file) == f_data.size());
+		fclose(file);
+		m_files.push_back(path);
+		return path;
+	}
+
+private:
+	std::string m_path;
+	std::vector<std::string> m_files;
+};
+
+static Bytes readFile(const std::string& f_path)
+{
+	Bytes data;
+	auto file = fopen(f_path.c_str(), "rb");
+	if(!file)
+		return data;
+	uchar buf[4096];
+	for(size_t n; (n = fread(buf, 1, sizeof(buf), file));)
+		data.insert(data.end(), buf, buf + n);
+	fclose(file);
+	return data;
+}
+
+static Bytes operator+(Bytes f_a, const Bytes& f_b)
+{
+	f_a.insert(f_a.end(), f_b.begin(), f_b.end());
+	return f_a;
+}
+
+static bool endsWith(const Bytes& f_data, const Bytes& f_end)
+{
+	return f_data.size() >= f_end.size() && std::equal(f_end.begin(), f_end.end(), f_data.end() - f_end.size());
+}
+
+// Not a tag of any kind
+static Bytes makeAudio(size_t f_size)
+{
+	Bytes audio(f_size);
+	for(size_t i = 0; i < f_size; ++i)
+		audio[i] = 0x40 + i % 31;
+	return audio;
+}
+
+static Bytes makeID3v1(const std::string& f_title)
+{
+	Bytes tag(128);
+	memcpy(&tag[0], "TAG", 3);
+	memcpy(&tag[3], f_title.data(), std::min<size_t>(f_title.size(), 30));
+	tag[127] = 0xFF;
+	return tag;
+}
+
+// An APEv2 tag with a footer only
+static Bytes makeAPE(const std::string& f_title)
+{
+	auto le = [](Bytes& f_out, uint f_x){ for(uint i = 0; i < 4; ++i) f_out.push_back((f_x >> (8 * i)) & 0xFF); };
+	Bytes tag;
+	le(tag, f_title.size());
+	le(tag, 0);
+	tag.insert(tag.end(), "Title", "Title" + 6);
+	tag.insert(tag.end(), f_title.begin(), f_title.end());
+
+	auto items = tag.size();
+	tag.insert(tag.end(), "APETAGEX", "APETAGEX" + 8);
+	le(tag, 2000);
+	le(tag, items + 32);
+	le(tag, 1);
+	le(tag, 0);
+	tag.resize(tag.size() + 8);
+	return tag;
+}
+
+// ================
+// A frame: v2.4 sizes are synchsafe
+static void appendFrame(Bytes& f_tag, uint f_version, const char* f_id, const std::string& f_payload)
+{
+	f_tag.insert(f_tag.end(), f_id, f_id + 4);
+	auto size = f_payload.size();
+	auto bits = (f_version >= 4) ? 7 : 8;
+	for(int i = 3; i >= 0; --i)
+		f_tag.push_back((size >> (bits * i)) & ((1 << bits) - 1));
+	f_tag.push_back(0);
+	f_tag.push_back(0);
+	f_tag.insert(f_tag.end(), f_payload.begin(), f_payload.end());
+}
+
+static Bytes makeHeader(uint f_version, size_t f_size)
+{
+	return Bytes{ 'I', 'D', '3', uchar(f_version), 0, 0,
+				  uchar((f_size >> 21) & 0x7F), uchar((f_size >> 14) & 0x7F),
+				  uchar((f_size >>  7) & 0x7F), uchar( f_size        & 0x7F) };
+}
+
+// A few text frames, a comment, an unknown frame and a picture of f_pictureSize bytes
+static Bytes makeTag(uint f_version, size_t f_paddingSize, size_t f_pictureSize = 16)
+{
+	Bytes frames;
+	appendFrame(frames, f_version, "TIT2", std::string("\0Some Title", 11));
+	appendFrame(frames, f_version, "TPE1", std::string("\0Some Artist", 12));
+	appendFrame(frames, f_version, "TALB", std::string("\0Some Album", 11));
+	appendFrame(frames, f_version, "COMM", std::string("\0eng\0A comment", 14));
+	appendFrame(frames, f_version, "PRIV", std::string("owner\0data", 10));
+	appendFrame(frames, f_version, "APIC", std::string("\0image/png\0\3\0", 13) + std::string(f_pictureSize, 'p'));
+	frames.resize(frames.size() + f_paddingSize);
+
+	auto tag = makeHeader(f_version, frames.size());
+	tag.insert(tag.end(), frames.begin(), frames.end());
+	return tag;
+}
+
+static std::shared_ptr<Tag::IID3v2> reparse(const Bytes& f_tag)
+{
+	Tag::Status status{Tag::Status::ErrNone, 0};
+	auto tag = Tag::IID3v2::create(f_tag.data(), 0, f_tag.size(), status);
+	CHECK(status.ok());
+	return tag;
+}
+
+// ================
+static void checkUnmodified()
+{
+	for(uint version = 3; version <= 4; ++version)
+	{
+		auto buf = makeTag(version, 256);
+		Bytes out;
+		Tag::IID3v2::create(buf.data(), 0, buf.size())->serialize(out);
+		CHECK(out == buf);
+
+		out.clear();
+		Tag::IID3v2::createBorrowed(buf.data(), 0, buf.size())->serialize(out);
+		CHECK(out == buf);
+	}
+}
+
+
+static void checkEdit()
+{
+	for(uint version = 3; version <= 4; ++version)
+	{
+		auto buf = makeTag(version, 256);
+		auto tag = Tag::IID3v2::create(buf.data(), 0, buf.size());
+		tag->setTitle(0, "A longer title than before");
+		tag->setComposer(0, "Zo\xC3\xAB");
+		tag->setComment(0, "Another comment");
+
+		// The padding takes the growth: the size is kept
+		Bytes out;
+		tag->serialize(out);
+		CHECK(out.size() == buf.size());
+
+		auto copy = reparse(out);
+		CHECK(copy->getTitle(0) == "A longer title than before");
+		CHECK(copy->getComposerCount() == 1 && copy->getComposer(0) == "Zo\xC3\xAB");
+		CHECK(copy->getComment(0) == "Another comment");
+		CHECK(copy->getArtist(0) == "Some Artist");
+		CHECK(copy->getAlbum(0) == "Some Album");
+		CHECK(copy->getUnknownFrames() == tag->getUnknownFrames());
+		CHECK(copy->getPictureCount() == 1);
+
+		// No room left: the tag grows
+		tag->setTitle(0, std::string(1000, 't'));
+		out.clear();
+		tag->serialize(out);
+		CHECK(out.size() > buf.size());
+		CHECK(reparse(out)->getTitle(0) == std::string(1000, 't'));
+	}
+}
+
+
+// Frames of 128 bytes and more: v2.4 sizes are synchsafe, v2.3 ones are not
+static void checkFrameSize()
+{
+	for(uint version = 3; version <= 4; ++version)
+	{
+		auto buf = makeTag(version, 0, 300);
+		auto tag = reparse(buf);
+		CHECK(tag->getPictureCount() == 1);
+
+		tag->setTitle(0, std::string(200, 't'));
+		Bytes out;
+		tag->serialize(out);
+		auto copy = reparse(out);
+		CHECK(copy->getTitle(0) == std::string(200, 't'));
+		CHECK(copy->getPictureCount() == 1);
+		CHECK(copy->getUnknownFrames() == tag->getUnknownFrames());
+
+		// The title is the first frame: 201 bytes
+		auto pSize = &out[10 + 4];
+		CHECK((version < 4) ? (pSize[2] == 0 && pSize[3] == 201) : (pSize[2] == 1 && pSize[3] == 201 - 128));
+	}
+}
+
+
+// The slot of the old tag is written in place when the new one fits,
+// otherwise the file is rewritten with the audio and the trailing tags
+static void checkSave()
+{
+	CTempDir dir;
+	auto audio = makeAudio(10000) + makeID3v1("Tail title");
+	for(uint version = 3; version <= 4; ++version)
+	{
+		auto buf = makeTag(version, 256);
+		auto path = dir.create("inplace.mp3", buf + audio);
+		auto tag = Tag::IID3v2::create(buf.data(), 0, buf.size());
+		tag->setTitle(0, "A longer title than before");
+		Tag::Status status{Tag::Status::ErrNone, 0};
+		CHECK(Tag::saveID3v2(path, *tag, status) && status.ok());
+
+		auto file = readFile(path);
+		CHECK(file.size() == buf.size() + audio.size());
+		CHECK(endsWith(file, audio));
+		CHECK(reparse(Bytes(file.begin(), file.begin() + buf.size()))->getTitle(0) == "A longer title than before");
+
+		// No padding: rewritten and padded to 4 KB
+		buf = makeTag(version, 0);
+		path = dir.create("rewrite.mp3", buf + audio);
+		tag = Tag::IID3v2::create(buf.data(), 0, buf.size());
+		tag->setTitle(0, "A longer title than before");
+		CHECK(!Tag::saveID3v2(path, *tag, status) && status.ok());
+
+		file = readFile(path);
+		CHECK(file.size() == 4096 + audio.size());
+		CHECK(endsWith(file, audio));
+		auto info = Tag::IFile::create(path, status);
+		CHECK(info && status.ok());
+		if(info)
+		{
+			CHECK(info->getAudioStart() == 4096 && info->getAudioEnd() == file.size() - 128);
+			CHECK(info->getID3v2() && info->getID3v2()->getTitle(0) == "A longer title than before");
+			CHECK(info->getID3v2() && info->getID3v2()->getPictureCount() == 1);
+			CHECK(info->getID3v1() && info->getID3v1()->getTitle() == "Tail title");
+		}
+
+		// No tag yet: a rewrite as well
+		path = dir.create("untagged.mp3", audio);
+		CHECK(!Tag::saveID3v2(path, *tag, status) && status.ok());
+		file = readFile(path);
+		CHECK(file.size() == 4096 + audio.size() && endsWith(file, audio));
+	}
+}
+
+
+// Files rewritten with some of their tags
+static void checkRewrite()
+{
+	CTempDir dir;
+	Tag::Status status{Tag::Status::ErrNone, 0};
+	auto head = makeTag(3, 64);
+	auto audio = makeAudio(10000);
+	auto ape = makeAPE("APE title");
+	auto id3v1 = makeID3v1("Tail title");
+	auto full = head + audio + ape + id3v1;
+
+	auto path = dir.create("keep.mp3", full);
+	CHECK(Tag::rewriteFile(path, Tag::KeepAll).ok());
+	CHECK(readFile(path) == full);
+
+	path = dir.create("strip.mp3", full);
+	CHECK(Tag::rewriteFile(path, Tag::KeepNone).ok());
+	CHECK(readFile(path) == audio);
+
+	path = dir.create("id3v1.mp3", full);
+	CHECK(Tag::rewriteFile(path, Tag::KeepID3v1).ok());
+	CHECK(readFile(path) == audio + id3v1);
+
+	// A new head and tail: the kept APE tag comes before the new ID3v1 one
+	auto newHead = makeTag(4, 0);
+	auto newID3v1 = makeID3v1("New title");
+	path = dir.create("replace.mp3", full);
+	CHECK(Tag::rewriteFile(path, Tag::KeepAPE, Tag::Span{newHead.data(), newHead.size()}, Tag::Span{newID3v1.data(), newID3v1.size()}).ok());
+	CHECK(readFile(path) == newHead + audio + ape + newID3v1);
+
+	auto info = Tag::IFile::create(path, status);
+	CHECK(info && status.ok());
+	if(info)
+	{
+		CHECK(info->getID3v2() && info->getAPE() && info->getID3v1());
+		CHECK(info->getID3v1() && info->getID3v1()->getTitle() == "New title");
+		CHECK(info->getAudioStart() == newHead.size() && info->getAudioEnd() == newHead.size() + audio.size());
+	}
+
+	// The mode is kept
+	chmod(path.c_str(), 0640);
+	CHECK(Tag::rewriteFile(path, Tag::KeepNone).ok());
+	struct stat st;
+	CHECK(stat(path.c_str(), &st) == 0 && (st.st_mode & 07777) == 0640);
+	CHECK(readFile(path) == audio);
+}
+
+
+// A tag borrowed from a mapping of the file is saved into its own slot:
+// the frames that move must not be read after they are overwritten
+static void checkSaveBorrowed()
+{
+	CTempDir dir;
+	auto audio = makeAudio(10000) + makeID3v1("Tail title");
+	for(uint version = 3; version <= 4; ++version)
+	{
+		auto buf = makeTag(version, 512, 300);
+		auto path = dir.create("mapped.mp3", buf + audio);
+		auto fd = open(path.c_str(), O_RDONLY);
+		CHECK(fd != -1);
+		auto pMap = static_cast<const uchar*>(mmap(nullptr, buf.size(), PROT_READ, MAP_SHARED, fd, 0));
+		CHECK(pMap != MAP_FAILED);
+		close(fd);
+
+		auto tag = Tag::IID3v2::createBorrowed(pMap, 0, buf.size());
+		tag->setTitle(0, "A longer title than before");
+		Bytes expected;
+		tag->serialize(expected);
+		Tag::Status status{Tag::Status::ErrNone, 0};
+		CHECK(Tag::saveID3v2(path, *tag, status) && status.ok());
+		munmap(const_cast<uchar*>(pMap), buf.size());
+
+		auto file = readFile(path);
+		CHECK(Bytes(file.begin(), file.begin() + buf.size()) == expected);
+		CHECK(endsWith(file, audio));
+
+		// The same through IFile
+		auto info = Tag::IFile::create(path, status, Tag::IFile::AccessMap);
+		CHECK(info && info->getID3v2());
+		if(!info || !info->getID3v2())
+			continue;
+		info->getID3v2()->setArtist(0, "A longer artist than before");
+		CHECK(Tag::saveID3v2(path, *info->getID3v2(), status) && status.ok());
+		info = Tag::IFile::create(path, status);
+		CHECK(info && status.ok() && info->getID3v2());
+		if(info && info->getID3v2())
+		{
+			CHECK(info->getID3v2()->getTitle(0) == "A longer title than before");
+			CHECK(info->getID3v2()->getArtist(0) == "A longer artist than before");
+			CHECK(info->getID3v2()->getAlbum(0) == "Some Album");
+			CHECK(info->getID3v2()->getPictureCount() == 1);
+		}
+	}
+}
+
+
+// The policy sees the growth of each save, not the growth since the tag was parsed
+class CRecordingPolicy : public Tag::IPaddingPolicy
+{
+public:
+	size_t getTagSize(size_t f_size) const override { return f_size + 100; }
+	void onEdit(size_t f_before, size_t f_after) override { edits.emplace_back(f_before, f_after); }
+
+	std::vector<std::pair<size_t, size_t>> edits;
+};
+
+static void checkSaveSizes()
+{
+	CTempDir dir;
+	auto audio = makeAudio(1000);
+	auto buf = makeTag(3, 256);
+	auto path = dir.create("sizes.mp3", buf + audio);
+	auto tag = Tag::IID3v2::create(buf.data(), 0, buf.size());
+	CRecordingPolicy policy;
+	Tag::Status status{Tag::Status::ErrNone, 0};
+
+	// 50 bytes more each time: in place while the padding lasts, then rewritten with 100 bytes
+	std::string title = "Some Title";
+	for(uint i = 0; i < 8; ++i)
+	{
+		auto padding = tag->getPaddingSize();
+		title += std::string(50, 'a' + i);
+		tag->setTitle(0, title);
+		bool inPlace = Tag::saveID3v2(path, *tag, policy, status);
+		CHECK(status.ok());
+		CHECK(inPlace == (padding >= 50));
+		CHECK(policy.edits.size() == i + 1 && policy.edits.back().second - policy.edits.back().first == 50);
+
+		// The tag is the one in the file
+		auto file = readFile(path);
+		CHECK(file.size() == tag->getSize() + audio.size());
+		CHECK(tag->getPaddingSize() == (inPlace ? padding - 50 : 100));
+		CHECK(tag->getTitle(0) == title && tag->getAlbum(0) == "Some Album" && tag->getPictureCount() == 1);
+		CHECK(reparse(Bytes(file.begin(), file.begin() + tag->getSize()))->getTitle(0) == title);
+	}
+
+	// A failed save is not reported
+	CHECK(!Tag::saveID3v2("/nonexistent/file.mp3", *tag, policy, status));
+	CHECK(!status.ok() && policy.edits.size() == 8);
+}
+
+
+// A head tag that is not parsed is skipped: the audio and the trailing tags are still found
+static void checkUnsupportedHead()
+{
+	CTempDir dir;
+	auto audio = makeAudio(10000);
+	auto tail = makeAPE("APE title") + makeID3v1("Tail title");
+
+	// v2.2 (three-character frame IDs), then v2.3 with unsynchronisation
+	Bytes frames{ 'T', 'T', '2', 0, 0, 6, 0, 'T', 'i', 't', 'l', 'e' };
+	frames.resize(frames.size() + 100);
+	auto v22 = makeHeader(2, frames.size()) + frames;
+	auto unsync = makeTag(3, 100);
+	unsync[5] = 0x80;
+
+	std::vector<std::string> paths{ dir.create("v22.mp3", v22 + audio + tail), dir.create("unsync.mp3", unsync + audio + tail) };
+	std::vector<size_t> heads{ v22.size(), unsync.size() };
+	auto checkFile = [&](size_t f_index, const Tag::Status& f_status, const std::shared_ptr<Tag::IFile>& f_file)
+	{
+		CHECK(f_status.ok() && f_file);
+		if(!f_file)
+			return;
+		CHECK(!f_file->getID3v2() && f_file->getID3v2Status().error == Tag::Status::ErrUnsupported);
+		CHECK(f_file->getAudioStart() == heads[f_index] && f_file->getAudioEnd() == heads[f_index] + audio.size());
+		CHECK(f_file->getAPE() && f_file->getID3v1() && f_file->getID3v1()->getTitle() == "Tail title");
+	};
+
+	for(size_t i = 0; i < paths.size(); ++i)
+	{
+		for(auto access : {Tag::IFile::AccessRead, Tag::IFile::AccessMap})
+		{
+			Tag::Status status{Tag::Status::ErrNone, 0};
+			auto file = Tag::IFile::create(paths[i], status, access);
+			checkFile(i, status, file);
+		}
+	}
+
+	size_t count = 0;
+	Tag::IBatch::create(4, Tag::IBatch::OrderGiven)->scan(paths, [&](size_t f_index, const Tag::Status& f_status, const std::shared_ptr<Tag::IFile>& f_file)
+	{
+		++count;
+		checkFile(f_index, f_status, f_file);
+	});
+	CHECK(count == paths.size());
+
+	// A supported tag has no status to report
+	Tag::Status status{Tag::Status::ErrNone, 0};
+	auto file = Tag::IFile::create(dir.create("v23.mp3", makeTag(3, 100) + audio), status);
+	CHECK(file && file->getID3v2() && file->getID3v2Status().ok());
+}
+
+
+// The head and the tail windows overlap on small files: no byte is read twice.
+// Larger files are read as the two windows.
+static void checkSmallFiles()
+{
+	CTempDir dir;
+	auto id3v1 = makeID3v1("Tail title");
+	std::vector<Bytes> files{ Bytes(), makeAudio(3), makeAudio(56) + id3v1, makeAudio(5000) + id3v1, makeTag(3, 100) + makeAudio(50) + id3v1, makeTag(3, 5000) + makeAudio(3000) + id3v1, makeAudio(70000) + id3v1 };
+	std::vector<std::string> paths;
+	for(size_t i = 0; i < files.size(); ++i)
+	{
+		auto path = dir.create("small" + std::to_string(i) + ".mp3", files[i]);
+		paths.push_back(path);
+		for(auto access : {Tag::IFile::AccessRead, Tag::IFile::AccessMap})
+		{
+			Tag::Status status{Tag::Status::ErrNone, 0};
+			auto file = Tag::IFile::create(path, status, access);
+			CHECK(file && status.ok());
+			if(!file)
+				continue;
+			CHECK(file->getBytesRead() == ((i + 1 < files.size()) ? files[i].size() : 2 * 4096));
+			CHECK(!file->getID3v1() == !endsWith(files[i], id3v1));
+			CHECK(!file->getID3v1() || file->getID3v1()->getTitle() == "Tail title");
+			CHECK(!file->getID3v2() || file->getID3v2()->getTitle(0) == "Some Title");
+		}
+	}
+
+	// The same reads from the batch scanner
+	Tag::IBatch::create(4, Tag::IBatch::OrderGiven)->scan(paths, [&](size_t f_index, const Tag::Status& f_status, const std::shared_ptr<Tag::IFile>& f_file)
+	{
+		CHECK(f_status.ok() && f_file);
+		if(f_file)
+			CHECK(f_file->getBytesRead() == ((f_index + 1 < files.size()) ? files[f_index].size() : 2 * 4096));
+	});
+}
+
+
+// MusicMatch comments are told apart by a "MusicMatch_" description, which must be terminated
+static void checkMMJB()
+{
+	auto ucs2 = [](const std::string& f_str)
+	{
+		std::string out("\xFF\xFE", 2);
+		for(auto c : f_str)
+			out += std::string(1, c) + '\0';
+		return out;
+	};
+
+	std::vector<std::pair<std::string, bool>> comments{
+		{ std::string("\0eng", 4) + "MusicMatch_Mood", false },
+		{ std::string("\0eng", 4) + std::string("MusicMatch_Mood\0Happy", 21), true },
+		{ std::string("\1eng", 4) + ucs2("MusicMatch_Mood") + std::string("\0", 1), false },
+		{ std::string("\1eng", 4) + ucs2("MusicMatch_Mood") + std::string("\0\0", 2) + ucs2("Happy"), true }
+	};
+	for(auto& comment : comments)
+	{
+		Bytes frames;
+		appendFrame(frames, 3, "COMM", comment.first);
+		auto tag = reparse(makeHeader(3, frames.size()) + frames);
+		CHECK(tag->getCommentCount() == (comment.second ? 0 : 1));
+		if(tag->getCommentCount())
+			CHECK(tag->getComment(0).empty());
+	}
+}
+
+
+// Payloads that cannot be decoded are reported and read as empty values
+static void checkMalformedFrames()
+{
+	Bytes frames;
+	// A lone UTF-16 surrogate, an odd-length UCS-2 string and a comment without text
+	appendFrame(frames, 3, "TIT2", std::string("\1\xFF\xFE\x00\xD8", 5));
+	appendFrame(frames, 3, "TPE1", std::string("\1\xFF\xFE" "A\0B", 6));
+	appendFrame(frames, 3, "COMM", std::string("\0eng", 4));
+	appendFrame(frames, 3, "TALB", std::string("\0Some Album", 11));
+	auto buf = makeHeader(3, frames.size()) + frames;
+	auto tag = reparse(buf);
+	if(!tag)
+		return;
+
+	try
+	{
+		CHECK(tag->getTitle(0).empty());
+		CHECK(tag->getArtist(0).empty());
+		CHECK(tag->getCommentCount() == 1 && tag->getComment(0).empty());
+		CHECK(tag->getAlbum(0) == "Some Album");
+	}
+	catch(const std::logic_error&)
+	{
+		CHECK(!"A getter throws");
+	}
+
+	CHECK(tag->getDiagnosticCount() == 3);
+	for(uint i = 0; i < tag->getDiagnosticCount(); ++i)
+		CHECK(tag->getDiagnostic(i).code == Tag::Diagnostic::DiagMalformedFrame);
+	// At the header of the title frame (read first)
+	CHECK(tag->getDiagnosticCount() && tag->getDiagnostic(0).offset == 10);
+
+	// The frames are kept as they are
+	Bytes out;
+	tag->serialize(out);
+	CHECK(out == buf);
+}
+
+static void checkConcurrentGetters()
+{
+	const uint comments = 64;
+	Bytes frames;
+	appendFrame(frames, 3, "TIT2", std::string("\0Some Title", 11));
+	for(uint i = 0; i < comments; ++i)
+		appendFrame(frames, 3, "COMM", std::string("\0eng", 4) + std::string("Short\0", 6) + std::to_string(i));
+	auto tag = reparse(makeHeader(3, frames.size()) + frames);
+
+	std::vector<std::thread> threads;
+	std::vector<uint> mismatches(4, 0);
+	for(uint t = 0; t < mismatches.size(); ++t)
+	{
+		threads.emplace_back([&, t]
+		{
+			for(uint i = 0; i < comments; ++i)
+			{
+				uint index = (i + t * comments / mismatches.size()) % comments;
+				if(tag->getComment(index) != std::to_string(index) || tag->getTitle(0) != "Some Title")
+					++mismatches[t];
+				tag->getDiagnosticCount();
+			}
+		});
+	}
+	for(auto& thread : threads)
+		thread.join();
+
+	for(auto mismatch : mismatches)
+		CHECK(!mismatch);
+	// One description diagnostic per comment, however the decodes interleaved
+	CHECK(tag->getDiagnosticCount() == comments);
+}
+
+
+#if defined(TAG_ASYNC)
+// createFileAsync on the bundled reactor finds what IFile::create does and reads as much
+static void checkAsync()
+{
+	CTempDir dir;
+	auto id3v1 = makeID3v1("Tail title");
+	std::vector<std::string> paths{
+		dir.create("async0.mp3", makeAudio(3)),
+		dir.create("async1.mp3", makeAudio(56) + id3v1),
+		dir.create("async2.mp3", makeAudio(70000) + makeAPE("APE title") + id3v1),
+		dir.create("async3.mp3", makeTag(3, 5000) + makeAudio(3000) + id3v1),
+		dir.create("async4.mp3", makeTag(4, 100, 100000) + makeAudio(200000) + id3v1),
+		dir.create("async5.mp3", Bytes())
+	};
+
+	auto reactor = Tag::IReactor::create(2);
+	std::mutex mutex;
+	std::condition_variable done;
+	size_t count = 0;
+	for(auto& path : paths)
+	{
+		Tag::start(Tag::createFileAsync(*reactor, path), [&, path](Tag::FileResult f_result)
+		{
+			Tag::Status status{Tag::Status::ErrNone, 0};
+			auto file = Tag::IFile::create(path, status);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			CHECK(f_result.status.error == status.error && !f_result.file == !file);
+			if(file && f_result.file)
+			{
+				CHECK(f_result.file->getAudioStart() == file->getAudioStart() && f_result.file->getAudioEnd() == file->getAudioEnd());
+				CHECK(f_result.file->getBytesRead() == file->getBytesRead());
+				CHECK(!f_result.file->getID3v2() == !file->getID3v2() && !f_result.file->getAPE() == !file->getAPE());
+				CHECK(!f_result.file->getID3v1() == !file->getID3v1());
+				CHECK(!f_result.file->getID3v1() || f_result.file->getID3v1()->getTitle() == "Tail title");
+			}
+			++count;
+			done.notify_one();
+		});
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&]{ return count == paths.size(); });
+}
+#endif
+
+// ================
+int main(int, char**)
+{
+	checkUnmodified();
+	checkEdit();
+	checkFrameSize();
+	checkMMJB();
+	checkMalformedFrames();
+	checkConcurrentGetters();
+	checkSave();
+	checkSaveBorrowed();
+	checkSaveSizes();
+	checkRewrite();
+	checkUnsupportedHead();
+	checkSmallFiles();
+#if defined(TAG_ASYNC)
+	checkAsync();
+#endif
+
+	LOG((s_failures ? "FAILED: " : "OK: ") << s_failures << " failure(s)");
+	return s_failures ? 1 : 0;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "tag.h"
+
+#include "common.h"
+
+#include <deque>
+#include <mutex>
+
+
+// Collects the diagnostics of a tag and forwards them to an optional sink.
+// Nothing is formatted or printed here, so a clean tag costs nothing.
+// The records may be read while lazily decoded frames report from other
+// threads: those reports are made under mutex().
+class CDiagnostics
+{
+public:
+	CDiagnostics(): m_base(nullptr), m_shift(0), m_sink(nullptr), m_issues(0) {}
+
+	void setSink(Tag::IDiagnosticSink* f_sink) { m_sink = f_sink; }
+
+	// Starts a new tag (offsets are relative to f_base); the storage is kept
+	void reset(const uchar* f_base)
+	{
+		m_base = f_base;
+		m_shift = 0;
+		m_records.clear();
+		m_issues = 0;
+	}
+
+	// The following reports are within a part of the tag held elsewhere:
+	// f_base is at f_offset from the beginning of the tag
+	void rebase(const uchar* f_base, size_t f_offset)
+	{
+		m_base = f_base;
+		m_shift = f_offset;
+	}
+
+	void report(Tag::Diagnostic::Code f_code, uint f_frameId, const uchar* f_where)
+	{
+		Tag::Diagnostic diagnostic = {f_code, f_frameId, static_cast<size_t>(f_where - m_base) + m_shift};
+		m_records.push_back(diagnostic);
+		if(diagnostic.isIssue())
+			++m_issues;
+		if(m_sink)
+			m_sink->report(diagnostic);
+	}
+
+	uint count() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_records.size();
+	}
+	// The reference stays valid until reset()
+	const Tag::Diagnostic& get(uint f_index) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_records.at(f_index);
+	}
+
+	bool hasIssues() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_issues;
+	}
+
+	std::mutex& mutex() const { return m_mutex; }
+
+private:
+	const uchar*					m_base;
+	size_t							m_shift;
+	Tag::IDiagnosticSink*			m_sink;
+
+	std::deque<Tag::Diagnostic>		m_records;
+	uint							m_issues;
+
+	mutable std::mutex				m_mutex;
+};
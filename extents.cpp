@@ -0,0 +1,72 @@
+#include "extents.h"
+
+#include <cstring> // memset
+
+#include <sys/stat.h>
+
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+
+bool CExtentMap::load(int f_fd)
+{
+	m_extents.clear();
+
+	struct stat st;
+	if(fstat(f_fd, &st) == -1)
+		return false;
+	m_device = st.st_dev;
+	m_inode = st.st_ino;
+	if(!st.st_size)
+		return false;
+
+#if defined(__linux__)
+	// The head and the tail are what is read: a few extents cover typical files
+	enum { MaxExtents = 16 };
+	alignas(fiemap) uchar buffer[sizeof(fiemap) + MaxExtents * sizeof(fiemap_extent)];
+	memset(buffer, 0, sizeof(buffer));
+	auto& request = *reinterpret_cast<fiemap*>(buffer);
+	request.fm_start = 0;
+	request.fm_length = FIEMAP_MAX_OFFSET;
+	request.fm_extent_count = MaxExtents;
+	if(ioctl(f_fd, FS_IOC_FIEMAP, &request) == 0)
+	{
+		for(uint i = 0; i < request.fm_mapped_extents; ++i)
+		{
+			auto& e = request.fm_extents[i];
+			// Not written yet or not on its own blocks
+			if(e.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))
+				continue;
+			m_extents.push_back(Extent{e.fe_logical, e.fe_physical, e.fe_length});
+		}
+		return isMapped();
+	}
+
+	// Older file systems (FIBMAP needs CAP_SYS_RAWIO)
+	int block = 0;
+	if(ioctl(f_fd, FIBMAP, &block) == 0 && block)
+	{
+		uint64_t blockSize = st.st_blksize;
+		m_extents.push_back(Extent{0, block * blockSize, blockSize});
+		return true;
+	}
+#endif
+	return false;
+}
+
+
+bool CExtentMap::getPhysical(uint64_t f_offset, uint64_t& f_physical) const
+{
+	for(auto& e : m_extents)
+	{
+		if(f_offset >= e.Logical && f_offset - e.Logical < e.Size)
+		{
+			f_physical = e.Physical + (f_offset - e.Logical);
+			return true;
+		}
+	}
+	return false;
+}
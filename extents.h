@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Where a file is on the disk: FIEMAP, or FIBMAP for the first block. The
+// mapping is a hint for ordering reads, not a guarantee (files change).
+class CExtentMap
+{
+public:
+	CExtentMap(): m_device(0), m_inode(0) {}
+
+	// False if the file system does not tell (the inode is the key then)
+	bool load(int f_fd);
+
+	bool isMapped() const { return !m_extents.empty(); }
+	uint64_t getDevice() const { return m_device; }
+	// The physical offset of the first byte, or the inode number
+	uint64_t getKey() const { return isMapped() ? m_extents[0].Physical : m_inode; }
+	// False if f_offset is not mapped
+	bool getPhysical(uint64_t f_offset, uint64_t& f_physical) const;
+
+private:
+	struct Extent
+	{
+		uint64_t	Logical;
+		uint64_t	Physical;
+		uint64_t	Size;
+	};
+
+	uint64_t			m_device;
+	uint64_t			m_inode;
+	std::vector<Extent>	m_extents;
+};
@@ -0,0 +1,231 @@
+#include "file.h"
+
+#include "id3v2.h"
+#include "reader.h"
+
+#include <algorithm>
+#include <cstddef> // offsetof
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// The largest footer (the whole ID3v1 tag)
+static const size_t s_footerMargin = 128;
+
+
+CFile::CFile(size_t f_size, const Tag::Limits& f_limits):
+	m_size(f_size),
+	m_limits(f_limits),
+	m_bytesRead(0),
+	m_headEnd(0),
+	m_audioEnd(f_size),
+	m_id3v2Status{Tag::Status::ErrNone, 0}
+{}
+
+
+Tag::Status CFile::load(CFileReader& f_reader)
+{
+	auto pData = f_reader.head(std::min<size_t>(m_size, HeadWindow));
+	if(f_reader.status().ok())
+		pData = f_reader.head(getHeadSize(pData));
+	if(!f_reader.status().ok())
+		return f_reader.status();
+
+	auto status = loadHead(pData);
+	if(!status.ok())
+		return status;
+
+	for(auto offset = getTailOffset();;)
+	{
+		pData = f_reader.tail(offset);
+		if(!f_reader.status().ok())
+			return f_reader.status();
+
+		auto next = loadTail(pData, offset, status);
+		if(next == offset)
+			break;
+		offset = next;
+	}
+
+	m_bytesRead = f_reader.bytesRead();
+	return status;
+}
+
+
+size_t CFile::getHeadSize(const uchar* f_data) const
+{
+	// The window is sized from the header
+	Tag::Probe probe;
+	Tag::Status status;
+	auto size = Tag::IID3v2::probe(f_data, 0, std::min<size_t>(m_size, HeadWindow), probe, status);
+	// A tag over the limit is rejected by loadHead without being read
+	if(!size || size > m_limits.tagSize)
+		return std::min<size_t>(m_size, HeadWindow);
+	return std::min(m_size, size);
+}
+
+
+Tag::Status CFile::loadHead(const uchar* f_data)
+{
+	using Tag::Status;
+
+	// f_data is nullptr for an empty file
+	if(m_size < sizeof(CID3v2::Tag_t::Header_t))
+		return Status{Status::ErrNone, 0};
+	auto& tag = *reinterpret_cast<const CID3v2::Tag_t*>(f_data);
+	if(!tag.Header.isValid())
+		return Status{Status::ErrNone, 0};
+
+	auto tagSize = tag.getSize();
+	if(tagSize > m_limits.tagSize)
+		return Status{Status::ErrLimit, offsetof(CID3v2::Tag_t::Header_t, SizeRaw)};
+	if(tagSize > m_size)
+		return Status{Status::ErrTruncated, m_size};
+
+	auto id3v2 = std::make_shared<CID3v2>();
+	id3v2->setLimits(m_limits);
+	auto status = id3v2->load(f_data, 0, tagSize, false);
+	if(status.ok())
+		m_id3v2 = id3v2;
+	m_headEnd = tagSize;
+
+	// The tag is skipped: the rest of the file is still located
+	if(status.error == Status::ErrUnsupported)
+	{
+		m_id3v2Status = status;
+		return Status{Status::ErrNone, 0};
+	}
+	return status;
+}
+
+
+size_t CFile::getTailOffset() const
+{
+	return m_size - std::min<size_t>(m_size - m_headEnd, TailWindow);
+}
+
+
+size_t CFile::loadTail(const uchar* f_data, size_t f_offset, Tag::Status& f_status)
+{
+	using Tag::Status;
+	using Tag::TailLayout;
+
+	TailLayout layout;
+	auto size = Tag::locateTail(f_data, m_size - f_offset, layout, f_status);
+	if(size > m_limits.tagSize)
+	{
+		f_status = Status{Status::ErrLimit, m_size - std::min(m_size, size)};
+		return f_offset;
+	}
+	// The tag does not fit or the next footer might be just before the window
+	if(f_status.error == Status::ErrTruncated && size <= m_size - m_headEnd)
+		return m_size - size;
+	if(f_status.ok() && layout.begin < s_footerMargin && f_offset > m_headEnd)
+	{
+		f_status.error = Status::ErrTruncated;
+		return m_size - std::min(m_size - m_headEnd, size + TailWindow);
+	}
+	if(!f_status.ok())
+	{
+		f_status.offset += f_offset;
+		return f_offset;
+	}
+
+	auto& tags = layout.tags;
+	if(tags[TailLayout::KindID3v1].size)
+		m_id3v1 = Tag::IID3v1::create(f_data, tags[TailLayout::KindID3v1].offset, tags[TailLayout::KindID3v1].size);
+	if(tags[TailLayout::KindAPE].size)
+		m_ape = Tag::IAPE::create(f_data, tags[TailLayout::KindAPE].offset, tags[TailLayout::KindAPE].size);
+	if(tags[TailLayout::KindLyrics].size)
+		m_lyrics = Tag::ILyrics::create(f_data, tags[TailLayout::KindLyrics].offset, tags[TailLayout::KindLyrics].size);
+	m_audioEnd = f_offset + layout.begin;
+
+	return f_offset;
+}
+
+// ====================================
+class CFileLoader : public Tag::IFileLoader
+{
+public:
+	CFileLoader(size_t f_size, const Tag::Limits& f_limits): m_file(std::make_shared<CFile>(f_size, f_limits)) {}
+
+	size_t getHeadWindow() const final override { return std::min<size_t>(m_file->getSize(), CFile::HeadWindow); }
+	size_t getHeadSize(const uchar* f_data) const final override { return m_file->getHeadSize(f_data); }
+	Tag::Status loadHead(const uchar* f_data) final override { return m_file->loadHead(f_data); }
+
+	size_t getTailOffset() const final override { return m_file->getTailOffset(); }
+	size_t loadTail(const uchar* f_data, size_t f_offset, Tag::Status& f_status) final override { return m_file->loadTail(f_data, f_offset, f_status); }
+
+	std::shared_ptr<Tag::IFile> getFile(size_t f_bytesRead) final override
+	{
+		m_file->setBytesRead(f_bytesRead);
+		return m_file;
+	}
+
+private:
+	std::shared_ptr<CFile> m_file;
+};
+
+// ====================================
+namespace Tag
+{
+	std::shared_ptr<IFile> IFile::create(const std::string& f_path, Access f_access)
+	{
+		Status status;
+		auto file = create(f_path, status, f_access);
+		ASSERT_MSG(file, f_path + ": " + status.str());
+		return file;
+	}
+
+	std::shared_ptr<IFile> IFile::create(const std::string& f_path, Status& f_status, Access f_access)
+	{
+		return create(f_path, Limits::none(), f_status, f_access);
+	}
+
+	std::shared_ptr<IFile> IFile::create(const std::string& f_path, const Limits& f_limits, Status& f_status, Access f_access)
+	{
+		auto fd = ::open(f_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1)
+		{
+			f_status = Status{Status::ErrIO, 0};
+			return nullptr;
+		}
+		auto file = create(fd, f_limits, f_status, f_access);
+		close(fd);
+		return file;
+	}
+
+	std::shared_ptr<IFile> IFile::create(int f_fd, Access f_access)
+	{
+		Status status;
+		auto file = create(f_fd, status, f_access);
+		ASSERT_MSG(file, status.str());
+		return file;
+	}
+
+	std::shared_ptr<IFile> IFile::create(int f_fd, Status& f_status, Access f_access)
+	{
+		return create(f_fd, Limits::none(), f_status, f_access);
+	}
+
+	std::shared_ptr<IFile> IFile::create(int f_fd, const Limits& f_limits, Status& f_status, Access f_access)
+	{
+		CFileReader reader(f_fd, f_access);
+		f_status = reader.open();
+		if(!f_status.ok())
+			return nullptr;
+
+		auto file = std::make_shared<CFile>(reader.size(), f_limits);
+		f_status = file->load(reader);
+		return f_status.ok() ? file : nullptr;
+	}
+
+	IFile::~IFile() {}
+
+	std::shared_ptr<IFileLoader> IFileLoader::create(size_t f_fileSize, const Limits& f_limits)
+	{
+		return std::make_shared<CFileLoader>(f_fileSize, f_limits);
+	}
+
+	IFileLoader::~IFileLoader() {}
+}
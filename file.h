@@ -0,0 +1,69 @@
+#pragma once
+
+#include "tag.h"
+
+#include "common.h"
+
+
+class CFileReader;
+
+
+// Locating works in two steps with any reader: the head (ID3v2) and the
+// tail window, each extended until the tags fit
+class CFile : public Tag::IFile
+{
+public:
+	// The first reads: enough for a typical ID3v2 header with a few frames and
+	// for the footers of the trailing tags
+	enum
+	{
+		HeadWindow = 4096,
+		TailWindow = 4096
+	};
+
+public:
+	explicit CFile(size_t f_size, const Tag::Limits& f_limits = Tag::Limits::none());
+
+	// Synchronous: both steps with the reader
+	Tag::Status load(CFileReader& f_reader);
+
+	// The number of head bytes to parse the ID3v2 tag (f_data is the first
+	// HeadWindow bytes or the whole file)
+	size_t getHeadSize(const uchar* f_data) const;
+	// f_data has getHeadSize() bytes
+	Tag::Status loadHead(const uchar* f_data);
+
+	// The offset of the first tail window (after loadHead)
+	size_t getTailOffset() const;
+	// f_data is the file from f_offset to the end. Returns the offset to
+	// extend the window to (with ErrTruncated) or f_offset when done.
+	size_t loadTail(const uchar* f_data, size_t f_offset, Tag::Status& f_status);
+
+	void setBytesRead(size_t f_bytesRead) { m_bytesRead = f_bytesRead; }
+
+	size_t getSize() const final override { return m_size; }
+	size_t getBytesRead() const final override { return m_bytesRead; }
+
+	size_t getAudioStart() const final override { return m_headEnd; }
+	size_t getAudioEnd() const final override { return m_audioEnd; }
+
+	std::shared_ptr<Tag::IID3v2> getID3v2() const final override { return m_id3v2; }
+	std::shared_ptr<Tag::IID3v1> getID3v1() const final override { return m_id3v1; }
+	std::shared_ptr<Tag::IAPE> getAPE() const final override { return m_ape; }
+	std::shared_ptr<Tag::ILyrics> getLyrics() const final override { return m_lyrics; }
+	Tag::Status getID3v2Status() const final override { return m_id3v2Status; }
+
+private:
+	size_t							m_size;
+	Tag::Limits						m_limits;
+	size_t							m_bytesRead;
+	// The audio data is between the head and the trailing tags
+	size_t							m_headEnd;
+	size_t							m_audioEnd;
+
+	std::shared_ptr<Tag::IID3v2>	m_id3v2;
+	Tag::Status						m_id3v2Status;
+	std::shared_ptr<Tag::IID3v1>	m_id3v1;
+	std::shared_ptr<Tag::IAPE>		m_ape;
+	std::shared_ptr<Tag::ILyrics>	m_lyrics;
+};
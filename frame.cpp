@@ -3,8 +3,7 @@
 #include "common.h"
 #include "utf8.h"
 
-#include <cstring> // memcpy
-#include <sstream>
+#include <cstring> // memchr, memcmp
 
 
 #define FCC_TRACK		FOUR_CC('T','R','C','K')
@@ -26,15 +25,8 @@
 #define FCC_PICTURE		FOUR_CC('A','P','I','C')
 
 // ============================================================================
-FrameType CFrame3::getFrameType(const Frame3::Header_t& f_header)
+CFrame3::Flags CFrame3::checkFlags(const Frame3::Header_t& f_header)
 {
-	if( !f_header.isValid() )
-	{
-		std::ostringstream oss;
-		oss << f_header.Id[0] << f_header.Id[1] << f_header.Id[2] << f_header.Id[3];
-		ASSERT_MSG(!"Invalid ID3v2 frame", oss.str());
-	}
-
 	enum TagFlags
 	{
 		TFTagAlter		= 0x0080,
@@ -46,20 +38,19 @@ FrameType CFrame3::getFrameType(const Frame3::Header_t& f_header)
 
 		TFReserved		= 0x1F1F
 	};
-	ASSERT(~f_header.Flags & TFTagAlter);
-	//ASSERT(~f_header.Flags & TFFileAlter);
-	ASSERT(~f_header.Flags & TFCompression);
-	ASSERT(~f_header.Flags & TFEncryption);
-	ASSERT(~f_header.Flags & TFGroupingId);
-	ASSERT( !(f_header.Flags & TFReserved) );
-
+	if(f_header.Flags & TFReserved)
+		return FlagsInvalid;
+	//TFFileAlter is allowed
+	if(f_header.Flags & (TFTagAlter | TFCompression | TFEncryption | TFGroupingId))
+		return FlagsUnsupported;
 	if(f_header.Flags & TFReadOnly)
-	{
-		std::ostringstream oss;
-		oss << f_header.Id[0] << f_header.Id[1] << f_header.Id[2] << f_header.Id[3];
-		WARNING("The \"" << oss.str() << "\" frame of the ID3v2 tag is read-only - the flag will be cleared if the frame is modified");
-	}
+		return FlagsReadOnly;
+	return FlagsOK;
+}
+
 
+FrameType CFrame3::getFrameType(const Frame3::Header_t& f_header)
+{
 	switch(f_header.IdFourCC)
 	{
 		case FCC_TRACK:		return FrameTrack;
@@ -84,14 +75,56 @@ FrameType CFrame3::getFrameType(const Frame3::Header_t& f_header)
 	}
 }
 
-// ============================================================================
-CRawFrame3::CRawFrame3(const Frame3& f_frame):
-	m_frame(sizeof(f_frame.Header) + f_frame.Header.size())
+
+uint CFrame3::getFrameId(FrameType f_type)
+{
+	switch(f_type)
+	{
+		case FrameTrack:		return FCC_TRACK;
+		case FrameDisc:			return FCC_DISC;
+		case FrameBPM:			return FCC_BPM;
+		case FrameTitle:		return FCC_TITLE;
+		case FrameArtist:		return FCC_ARTIST;
+		case FrameAlbum:		return FCC_ALBUM;
+		case FrameAlbumArtist:	return FCC_AARTIST;
+		case FrameYear:			return FCC_YEAR;
+		case FrameComposer:		return FCC_COMPOSER;
+		case FramePublisher:	return FCC_PUBLISHER;
+		case FrameOrigArtist:	return FCC_OARTIST;
+		case FrameCopyright:	return FCC_COPYRIGHT;
+		case FrameEncoded:		return FCC_ENCODED;
+		case FrameGenre:		return FCC_GENRE;
+		case FrameComment:		return FCC_COMMENT;
+		case FrameURL:			return FCC_URL;
+		case FramePicture:		return FCC_PICTURE;
+
+		default:				ASSERT(!"No frame ID");
+	}
+}
+
+
+void CFrame3::encode(uint f_id, uint f_version, std::vector<uchar>& f_out) const
 {
-	memcpy(&m_frame[0], &f_frame, m_frame.size());
-	m_id = std::string(f_frame.Header.Id, sizeof(f_frame.Header.Id));
+	auto begin = f_out.size();
+	f_out.resize(begin + sizeof(Frame3::Header_t));
+	encodePayload(f_version, f_out);
+
+	// The size is synchsafe for v2.4 (see Frame3::Header_t::size)
+	auto& header = *reinterpret_cast<Frame3::Header_t*>(&f_out[begin]);
+	auto size = f_out.size() - begin - sizeof(header);
+	header.IdFourCC = f_id;
+	for(uint i = 0; i < 4; ++i)
+		header.SizeRaw[i] = (f_version < 4) ? (size >> (24 - 8 * i)) & 0xFF : (size >> (21 - 7 * i)) & 0x7F;
+	header.Flags = 0;
 }
 
+// ============================================================================
+CRawFrame3::CRawFrame3(const Frame3& f_frame, size_t f_size):
+	CFrame3(f_frame, f_size),
+	m_frame(f_frame),
+	m_id(f_frame.Header.Id, sizeof(f_frame.Header.Id))
+{}
+
 // ============================================================================
 static std::string toString(const char* f_data, size_t f_size, Encoding f_encoding)
 {
@@ -101,11 +134,11 @@ static std::string toString(const char* f_data, size_t f_size, Encoding f_encodi
 	switch(f_encoding)
 	{
 		case EncRaw:
-			return std::string(f_data, f_size);
+			return UTF8::fromLatin1(f_data, f_size);
 		case EncUCS2:
 			return UTF8::fromUCS2(f_data, f_size);
 		case EncUTF16BE:
-			ASSERT(!"UTF-16BE");
+			return UTF8::fromUTF16BE(f_data, f_size);
 		case EncUTF8:
 			return std::string(f_data, f_size);
 		default:
@@ -114,10 +147,51 @@ static std::string toString(const char* f_data, size_t f_size, Encoding f_encodi
 }
 
 
-CTextFrame3::CTextFrame3(const Frame3& f_frame)
+// New text: UTF-8 since ID3v2.4, else ISO-8859-1 if possible or UCS-2
+static Encoding chooseEncoding(const std::string& f_text, uint f_version)
+{
+	std::string latin1;
+	if(f_version >= 4)
+		return EncUTF8;
+	return UTF8::toLatin1(f_text, latin1) ? EncRaw : EncUCS2;
+}
+
+static void appendString(std::vector<uchar>& f_out, const std::string& f_text, Encoding f_encoding, bool f_bTerminate)
 {
-	auto& frame = *reinterpret_cast<const TextFrame3*>(f_frame.Data);
-	auto size = f_frame.Header.size();
+	std::string str;
+	switch(f_encoding)
+	{
+		case EncRaw:
+			ASSERT_MSG(UTF8::toLatin1(f_text, str), "Not an ISO-8859-1 string");
+			break;
+		case EncUCS2:
+			str = UTF8::toUCS2(f_text);
+			break;
+		case EncUTF8:
+			str = f_text;
+			break;
+		default:
+			ASSERT(!"Unsupported encoding");
+	}
+	f_out.insert(f_out.end(), str.begin(), str.end());
+
+	if(f_bTerminate)
+		f_out.resize(f_out.size() + (f_encoding == EncUCS2 ? 2 : 1), 0);
+}
+
+
+void CTextFrame3::encodeText(const std::string& f_text, uint f_version, std::vector<uchar>& f_out)
+{
+	auto encoding = chooseEncoding(f_text, f_version);
+	f_out.push_back(encoding);
+	appendString(f_out, f_text, encoding, false);
+}
+
+
+void CTextFrame3::decodePayload(const uchar* f_data, size_t f_size, CDiagnostics&)
+{
+	auto& frame = *reinterpret_cast<const TextFrame3*>(f_data);
+	auto size = f_size;
 
 	ASSERT(size >= sizeof(frame.Encoding));
 	m_encodingRaw = static_cast<Encoding>(frame.Encoding);
@@ -175,43 +249,99 @@ void CGenreFrame3::parse()
 		m_indexV1 = Tag::genre(m_text);
 }
 
+void CGenreFrame3::encodePayload(uint f_version, std::vector<uchar>& f_out) const
+{
+	if(m_indexV1 < 0)
+		encodeText(m_text, f_version, f_out);
+	else
+		encodeText("(" + std::to_string(m_indexV1) + ")" + (m_extended ? m_text : std::string()), f_version, f_out);
+}
+
 // ============================================================================
-template<typename T>
-static std::string parseTextField(const T* f_data, size_t& f_ioSize, Encoding f_encoding)
+static std::string parseTextField(const char* f_data, size_t& f_ioSize, Encoding f_encoding)
 {
 	// Search for . . . <0> . . .
-	for(size_t i = 0, n = f_ioSize; i < n; i += sizeof(T))
+	size_t i, sizeNull;
+	switch(f_encoding)
 	{
-		ASSERT(reinterpret_cast<const char*>(reinterpret_cast<const T*>(reinterpret_cast<const char*>(f_data) + i) + 1) <=
-			   reinterpret_cast<const char*>(f_data) + n);
-		if(*(const T*)((const char*)f_data + i) == 0)
+		case EncRaw:
+		case EncUTF8:
 		{
-			f_ioSize = i + sizeof(T);
-			return toString(reinterpret_cast<const char*>(f_data), i, f_encoding);
+			auto p = static_cast<const char*>(memchr(f_data, 0, f_ioSize));
+			i = p ? p - f_data : f_ioSize;
+			sizeNull = sizeof(char);
+			break;
 		}
+		default:
+			i = UTF8::findNull16(f_data, f_ioSize);
+			sizeNull = sizeof(short);
 	}
+
 	// No need to update the f_ioSize if it was 0 or the end of the first string was not found
-	return std::string("");
+	if(i == f_ioSize)
+		return std::string("");
+
+	f_ioSize = i + sizeNull;
+	return toString(f_data, i, f_encoding);
 }
 
-static std::string parseTextField(const char* f_data, size_t& f_ioSize, Encoding f_encoding)
+
+static const char s_prefixMMJB[] = "MusicMatch_";
+static const size_t s_prefixMMJBLength = sizeof(s_prefixMMJB) - 1;
+
+bool CCommentFrame3::hasMMJBPrefix(const std::string& f_str)
 {
-	switch(f_encoding)
+	return (f_str.compare(0, s_prefixMMJBLength, s_prefixMMJB) == 0);
+}
+
+
+// Compares the raw short description with the (ASCII) prefix, so nothing is
+// transcoded. The description must end within the frame, as decoding expects.
+bool CCommentFrame3::isMMJB(const Frame3& f_frame, size_t f_size)
+{
+	auto& frame = *reinterpret_cast<const CommentFrame3*>(f_frame.Data);
+	if(f_size <= sizeof(frame.Encoding) + sizeof(frame.Language))
+		return false;
+
+	auto p = reinterpret_cast<const uchar*>(frame.RawShortString);
+	auto size = f_size - sizeof(frame.Encoding) - sizeof(frame.Language);
+
+	bool bigEndian;
+	switch(frame.Encoding)
 	{
 		case EncRaw:
 		case EncUTF8:
-			return parseTextField<char>(f_data, f_ioSize, f_encoding);
+			return (size >= s_prefixMMJBLength && !memcmp(p, s_prefixMMJB, s_prefixMMJBLength) &&
+					memchr(p + s_prefixMMJBLength, 0, size - s_prefixMMJBLength));
+		case EncUCS2:
+			bigEndian = (size >= 2 && p[0] == 0xFE && p[1] == 0xFF);
+			if(size >= 2 && ((p[0] == 0xFF && p[1] == 0xFE) || bigEndian))
+			{
+				p += 2;
+				size -= 2;
+			}
+			break;
 		default:
-			return parseTextField<short>(reinterpret_cast<const short*>(f_data), f_ioSize, f_encoding);
+			bigEndian = true;
+	}
+
+	if(size < 2 * s_prefixMMJBLength)
+		return false;
+	for(size_t i = 0; i < s_prefixMMJBLength; ++i, p += 2)
+	{
+		uint c = bigEndian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]);
+		if(c != static_cast<uchar>(s_prefixMMJB[i]))
+			return false;
 	}
+	size -= 2 * s_prefixMMJBLength;
+	return (UTF8::findNull16(reinterpret_cast<const char*>(p), size) < size);
 }
 
 
-CCommentFrame3::CCommentFrame3(const Frame3& f_frame, bool f_bMMJB):
-	CTextFrame3("")
+void CCommentFrame3::decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics)
 {
-	auto& frame = *reinterpret_cast<const CommentFrame3*>(f_frame.Data);
-	auto size = f_frame.Header.size();
+	auto& frame = *reinterpret_cast<const CommentFrame3*>(f_data);
+	auto size = f_size;
 
 	ASSERT(size > sizeof(frame.Encoding) + sizeof(frame.Language));
 	m_encodingRaw = (Encoding)frame.Encoding;
@@ -222,32 +352,37 @@ CCommentFrame3::CCommentFrame3(const Frame3& f_frame, bool f_bMMJB):
 	auto uRawSize = size - sizeof(frame.Encoding) - sizeof(frame.Language);
 	auto shortNameSize = uRawSize;
 
-	m_short = parseShortString(frame.RawShortString, /*io*/shortNameSize, m_encodingRaw, f_bMMJB);
+	m_short = parseShortString(frame.RawShortString, /*io*/shortNameSize, m_encodingRaw);
+	if(!m_bMMJB && !m_short.empty())
+		f_diagnostics.report(Tag::Diagnostic::DiagShortComment, FOUR_CC('C','O','M','M'), f_data - sizeof(Frame3::Header_t));
 
 	ASSERT(shortNameSize <= uRawSize);
 	m_text = toString(frame.RawShortString + shortNameSize, uRawSize - shortNameSize, m_encodingRaw);
 }
 
-std::string CCommentFrame3::parseShortString(const char* f_data, size_t& f_ioSize, Encoding f_encoding, bool f_bMMJB) const
+void CCommentFrame3::encodePayload(uint f_version, std::vector<uchar>& f_out) const
+{
+	// One encoding for both strings
+	auto encoding = chooseEncoding(m_short + m_text, f_version);
+	f_out.push_back(encoding);
+	f_out.insert(f_out.end(), m_lang, m_lang + sizeof(m_lang));
+	appendString(f_out, m_short, encoding, true);
+	appendString(f_out, m_text, encoding, false);
+}
+
+std::string CCommentFrame3::parseShortString(const char* f_data, size_t& f_ioSize, Encoding f_encoding) const
 {
 	auto str = parseTextField(f_data, /*io*/f_ioSize, f_encoding);
-	if(f_bMMJB)
+	if(m_bMMJB)
 		ASSERT(hasMMJBPrefix(str));
-	else if(!str.empty())
-	{
-		if( hasMMJBPrefix(str) )
-			throw ExceptionMMJB();
-		WARNING("short comment \"" << str << "\" is present");
-	}
 	return str;
 }
 
 // ============================================================================
-CURLFrame3::CURLFrame3(const Frame3& f_frame):
-	CTextFrame3("")
+void CURLFrame3::decodePayload(const uchar* f_data, size_t f_size, CDiagnostics&)
 {
-	auto& frame = *reinterpret_cast<const URLFrame3*>(f_frame.Data);
-	auto size = f_frame.Header.size();
+	auto& frame = *reinterpret_cast<const URLFrame3*>(f_data);
+	auto size = f_size;
 
 	ASSERT(size > sizeof(frame.Encoding));
 	m_encodingRaw = (Encoding)frame.Encoding;
@@ -262,11 +397,20 @@ CURLFrame3::CURLFrame3(const Frame3& f_frame):
 	m_text = toString(frame.Description + descSize, uRawSize - descSize, EncRaw);
 }
 
+void CURLFrame3::encodePayload(uint f_version, std::vector<uchar>& f_out) const
+{
+	// The URL itself is always ISO-8859-1
+	auto encoding = chooseEncoding(m_description, f_version);
+	f_out.push_back(encoding);
+	appendString(f_out, m_description, encoding, true);
+	appendString(f_out, m_text, EncRaw, false);
+}
+
 // ============================================================================
-CPictureFrame3::CPictureFrame3(const Frame3& f_frame)
+void CPictureFrame3::decodePayload(const uchar* f_data, size_t f_size, CDiagnostics&)
 {
-	auto& frame = *reinterpret_cast<const PictureFrame3*>(f_frame.Data);
-	auto size = f_frame.Header.size();
+	auto& frame = *reinterpret_cast<const PictureFrame3*>(f_data);
+	auto size = f_size;
 
 	// Encoding
 	ASSERT(size > sizeof(frame.Encoding));
@@ -296,7 +440,7 @@ CPictureFrame3::CPictureFrame3(const Frame3& f_frame)
 	pData += sz;
 
 	// Image Data
-	m_data.resize(size);
-	memcpy(&m_data[0], pData, size);
+	m_data.data = reinterpret_cast<const uchar*>(pData);
+	m_data.size = size;
 }
 
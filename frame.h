@@ -3,7 +3,9 @@
 #include "tag.h"
 
 #include "common.h"
+#include "diagnostics.h"
 
+#include <atomic>
 #include <vector>
 
 
@@ -28,6 +30,7 @@ enum FrameType
 	FramePicture,
 	FrameMMJB,
 	FrameUnknown,
+	FrameTypeCount,
 
 	FrameDword = 0xFFFFFFFF
 };
@@ -54,19 +57,32 @@ struct __attribute__ ((__packed__)) Frame3
 		uchar		SizeRaw[4];
 		ushort		Flags;
 
+		// [0-9A-Z]{4}: all characters are checked at once
 		bool isValid() const
 		{
-			for(uint i = 0; i < sizeof(Id) / sizeof(Id[0]); ++i)
-			{
-				char c = Id[i];
-				if(c < '0' || (c > '9' && c < 'A') || c > 'Z')
-					return false;
-			}
-			return true;
+			uint x = IdFourCC & 0x7F7F7F7F;
+			return (!(IdFourCC & 0x80808080) &&
+					(inRange(x, '0', '9') | inRange(x, 'A', 'Z')) == 0x80808080);
 		}
 
-		size_t		size() const { return (SizeRaw[0]<<24) | (SizeRaw[1]<<16) | (SizeRaw[2]<<8) | SizeRaw[3]; }
+		// v2.4 sizes are synchsafe (7 bits per byte), v2.3 ones are plain 32-bit numbers
+		bool		isValidSize(uint f_version) const { return f_version < 4 || !((SizeRaw[0] | SizeRaw[1] | SizeRaw[2] | SizeRaw[3]) & 0x80); }
+		size_t		size(uint f_version) const
+		{
+			return (f_version < 4) ?
+				   (SizeRaw[0]<<24) | (SizeRaw[1]<<16) | (SizeRaw[2]<<8) | SizeRaw[3] :
+				   (SizeRaw[0]<<21) | (SizeRaw[1]<<14) | (SizeRaw[2]<<7) | SizeRaw[3];
+		}
 		std::string	str	() const { return std::string(1,Id[0]) + Id[1] + Id[2] + Id[3]; }
+
+	private:
+		// Sets the high bit of every 7-bit byte of f_x that is within [f_lo, f_hi]
+		static uint inRange(uint f_x, uint f_lo, uint f_hi)
+		{
+			return ((f_x + (0x80 - f_lo) * 0x01010101) &
+				   ~(f_x + (0x7F - f_hi) * 0x01010101) &
+					0x80808080);
+		}
 	} Header;
 	uchar Data[];
 };
@@ -106,40 +122,104 @@ struct __attribute__ ((__packed__)) PictureFrame3
 class CFrame3
 {
 public:
+	enum Flags
+	{
+		FlagsOK,
+		FlagsReadOnly,
+		FlagsUnsupported,
+		FlagsInvalid
+	};
+	static Flags checkFlags(const Frame3::Header_t& f_header);
+	// The header is expected to be valid
 	static FrameType getFrameType(const Frame3::Header_t& f_header);
+	// Decoded to strings (MusicMatch frames are kept raw)
+	static bool isText(FrameType f_type) { return f_type < FramePicture; }
+	// The ID of new frames of the type (not FrameMMJB and FrameUnknown)
+	static uint getFrameId(FrameType f_type);
 
 public:
-	CFrame3() = default;
+	// A new frame (always modified)
+	CFrame3(): m_source(nullptr), m_sourceSize(0), m_original(nullptr), m_modified(true) {}
+	// The payload (f_size bytes) is not touched until decode() is called,
+	// so f_frame must outlive the object
+	CFrame3(const Frame3& f_frame, size_t f_size): m_source(&f_frame), m_sourceSize(f_size), m_original(&f_frame), m_modified(false) {}
 	virtual ~CFrame3() {}
 
-	//bool isModified() const { return m_modified; }
-//	void setModified() { m_modified = true; }
+	// Decodes the source frame on the first call. Const getters of a tag call
+	// it, so concurrent first calls are serialized by the diagnostics mutex.
+	// A malformed payload is reported and leaves the frame empty (false).
+	bool decode(CDiagnostics& f_diagnostics)
+	{
+		if(!m_source.load(std::memory_order_acquire))
+			return true;
+		std::lock_guard<std::mutex> lock(f_diagnostics.mutex());
+		const Frame3* source = m_source.load(std::memory_order_relaxed);
+		if(!source)
+			return true;
 
-//protected:
-//	CFrame3(): m_modified(false) {}
+		bool ok = true;
+		try
+		{
+			decodePayload(source->Data, m_sourceSize, f_diagnostics);
+		}
+		catch(const std::logic_error&)
+		{
+			clearPayload();
+			f_diagnostics.report(Tag::Diagnostic::DiagMalformedFrame, source->Header.IdFourCC, reinterpret_cast<const uchar*>(source));
+			ok = false;
+		}
+		m_source.store(nullptr, std::memory_order_release);
+		return ok;
+	}
+
+	// The frame in the tag buffer (nullptr for a new frame): unmodified
+	// frames are serialized as they are
+	const Frame3* getOriginal() const { return m_original; }
+	bool isModified() const { return m_modified; }
+	void setModified() { m_modified = true; }
 
-//protected:
-//	bool m_modified;
+	// Appends the whole frame with f_id (the flags are cleared)
+	void encode(uint f_id, uint f_version, std::vector<uchar>& f_out) const;
+
+protected:
+	virtual void decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics) = 0;
+	// Resets what a failed decodePayload() may have left
+	virtual void clearPayload() {}
+	// Only frames with setters are encoded
+	virtual void encodePayload(uint, std::vector<uchar>&) const { ASSERT(!"Not editable"); }
+
+private:
+	std::atomic<const Frame3*>	m_source;
+	size_t						m_sourceSize;
+	const Frame3*				m_original;
+	bool						m_modified;
 };
 
 
+// Refers to the frame in the tag buffer, which must outlive the object
 class CRawFrame3 : public CFrame3
 {
 public:
-	CRawFrame3(const Frame3& f_frame);
+	CRawFrame3(const Frame3& f_frame, size_t f_size);
 	CRawFrame3() = delete;
 	const std::string& getId() const { return m_id; }
 
 protected:
-	std::vector<char> m_frame;
-	std::string m_id;
+	void decodePayload(const uchar*, size_t, CDiagnostics&) override {}
+
+protected:
+	const Frame3&	m_frame;
+	std::string		m_id;
 };
 
 
 class CTextFrame3 : public CFrame3
 {
 public:
-	CTextFrame3(const Frame3& f_frame);
+	CTextFrame3(const Frame3& f_frame, size_t f_size):
+		CFrame3(f_frame, f_size),
+		m_encodingRaw(EncRaw)
+	{}
 	explicit CTextFrame3(const std::string& f_text):
 		m_encodingRaw(EncUCS2),
 		m_text(f_text)
@@ -147,7 +227,14 @@ public:
 	CTextFrame3() = delete;
 
 	const std::string&	getText() const						{ return m_text; }
-	virtual void		setText(const std::string& f_text) 	{ m_text = f_text; /*setModified();*/ }
+	virtual void		setText(const std::string& f_text) 	{ m_text = f_text; setModified(); }
+
+protected:
+	void decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics) override;
+	void clearPayload() override { m_text.clear(); }
+	void encodePayload(uint f_version, std::vector<uchar>& f_out) const override { encodeText(m_text, f_version, f_out); }
+	// The encoding byte and f_text
+	static void encodeText(const std::string& f_text, uint f_version, std::vector<uchar>& f_out);
 
 protected:
 	Encoding	m_encodingRaw;
@@ -165,13 +252,11 @@ public:
 	 *	"text"			-> text + corresponding index
 	 *	"(index)text"	-> index + text (+extended if index != text)
 	*/
-	CGenreFrame3(const Frame3& f_frame):
-		CTextFrame3(f_frame),
+	CGenreFrame3(const Frame3& f_frame, size_t f_size):
+		CTextFrame3(f_frame, f_size),
 		m_indexV1(-1),
 		m_extended(false)
-	{
-		parse();
-	}
+	{}
 	explicit CGenreFrame3(const std::string f_text):
 		CTextFrame3(f_text),
 		m_indexV1(-1),
@@ -191,7 +276,7 @@ public:
 	{
 		m_indexV1 = f_index;
 		updateExtended();
-		//setModified();
+		setModified();
 	}
 
 	void setText(const std::string& f_text) override
@@ -202,6 +287,21 @@ public:
 
 	bool isExtended() const { return m_extended; }
 
+protected:
+	void decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics) override
+	{
+		CTextFrame3::decodePayload(f_data, f_size, f_diagnostics);
+		parse();
+	}
+	void clearPayload() override
+	{
+		CTextFrame3::clearPayload();
+		m_indexV1 = -1;
+		m_extended = false;
+	}
+	// "(index)", "(index)text" or "text"
+	void encodePayload(uint f_version, std::vector<uchar>& f_out) const override;
+
 private:
 	void parse();
 	void updateExtended() { m_extended = (m_text != Tag::genre(m_indexV1)); }
@@ -216,9 +316,14 @@ protected:
 class CCommentFrame3 : public CTextFrame3
 {
 public:
-	CCommentFrame3(const Frame3& f_frame): CCommentFrame3(f_frame, false) {}
+	// Checks the short description only (cheap enough for the indexing pass)
+	static bool isMMJB(const Frame3& f_frame, size_t f_size);
+
+public:
+	CCommentFrame3(const Frame3& f_frame, size_t f_size): CCommentFrame3(f_frame, f_size, false) {}
 	explicit CCommentFrame3(const std::string f_text):
-		CTextFrame3(f_text)
+		CTextFrame3(f_text),
+		m_bMMJB(false)
 	{
 		m_lang[0] = 'e';
 		m_lang[1] = 'n';
@@ -236,57 +341,88 @@ public:
 	}
 
 protected:
-	CCommentFrame3(const Frame3& f_frame, bool f_bMMJB);
+	CCommentFrame3(const Frame3& f_frame, size_t f_size, bool f_bMMJB):
+		CTextFrame3(f_frame, f_size),
+		m_bMMJB(f_bMMJB)
+	{}
 
-private:
-	// Shared with and used for MMJB
-	static bool hasMMJBPrefix(const std::string& f_str)
+	void decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics) override;
+	void clearPayload() override
 	{
-		static const std::string prefixMMJB = "MusicMatch_";
-		return (f_str.compare(0, prefixMMJB.length(), prefixMMJB) == 0);
+		CTextFrame3::clearPayload();
+		m_short.clear();
 	}
-	std::string parseShortString(const char* f_data, size_t& f_ioSize, Encoding f_encoding, bool f_bMMJB) const;
+	void encodePayload(uint f_version, std::vector<uchar>& f_out) const override;
+
+private:
+	// Shared with and used for MMJB
+	static bool hasMMJBPrefix(const std::string& f_str);
+	std::string parseShortString(const char* f_data, size_t& f_ioSize, Encoding f_encoding) const;
 
 protected:
+	bool		m_bMMJB;
 	uchar		m_lang[3];
 	std::string	m_short;
-
-public:
-	class ExceptionMMJB {};
 };
 
 
 class /*MusicMatch Jukebox*/ CMMJBFrame3 : public CCommentFrame3
 {
 public:
-	CMMJBFrame3(const Frame3& f_frame): CCommentFrame3(f_frame, true) {}
+	CMMJBFrame3(const Frame3& f_frame, size_t f_size): CCommentFrame3(f_frame, f_size, true) {}
 };
 
 
 class CURLFrame3 : public CTextFrame3
 {
 public:
-	CURLFrame3(const Frame3& f_frame);
+	CURLFrame3(const Frame3& f_frame, size_t f_size): CTextFrame3(f_frame, f_size) {}
 	explicit CURLFrame3(const std::string& f_text): CTextFrame3(f_text) {}
 	CURLFrame3() = delete;
 
 	const std::string& getDescription() const { return m_description; }
 
+protected:
+	void decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics) override;
+	void clearPayload() override
+	{
+		CTextFrame3::clearPayload();
+		m_description.clear();
+	}
+	void encodePayload(uint f_version, std::vector<uchar>& f_out) const override;
+
 protected:
 	std::string	m_description;
 };
 
 
+// Refers to the image in the tag buffer, which must outlive the object
 class CPictureFrame3 : public CFrame3
 {
 public:
-	CPictureFrame3(const Frame3& f_frame);
+	CPictureFrame3(const Frame3& f_frame, size_t f_size):
+		CFrame3(f_frame, f_size),
+		m_encodingRaw(EncRaw),
+		m_type(PTOther),
+		m_data{nullptr, 0}
+	{}
 	CPictureFrame3() = delete;
 
-	const std::vector<uchar>& getData()	const { return m_data;			}
-	//const std::string& getType()		const { return m_type;			}
+	Tag::Span getData()					const { return m_data;			}
+	const std::string& getMIME()		const { return m_mime;			}
+	uint getType()						const { return m_type;			}
 	const std::string& getDescription()	const { return m_description;	}
 
+protected:
+	void decodePayload(const uchar* f_data, size_t f_size, CDiagnostics& f_diagnostics) override;
+	void clearPayload() override
+	{
+		m_mime.clear();
+		m_type = PTOther;
+		m_description.clear();
+		m_data = Tag::Span{nullptr, 0};
+	}
+
 private:
 	//template<typename T>
 	//void fill(const T* f_data, size_t f_size, uint f_step = sizeof(T));
@@ -322,6 +458,7 @@ protected:
 	std::string			m_mime;
 	PictureType			m_type;
 	std::string			m_description;
-	std::vector<uchar>	m_data;
+	// Points to the tag buffer
+	Tag::Span			m_data;
 };
 
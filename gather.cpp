@@ -0,0 +1,124 @@
+#include "tag.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits> // IOV_MAX
+#include <sys/uio.h>
+
+#if !defined(IOV_MAX)
+#define IOV_MAX 16
+#endif
+
+
+namespace Tag
+{
+	// Padding comes from here
+	static const unsigned char s_zeros[64 * 1024] = {};
+
+
+	void GatherList::addSpan(const unsigned char* f_data, size_t f_size)
+	{
+		commit();
+		if(!f_size)
+			return;
+		if(!m_pieces.empty() && m_pieces.back().data && m_pieces.back().data + m_pieces.back().size == f_data)
+			m_pieces.back().size += f_size;
+		else
+			m_pieces.push_back(Piece{f_data, 0, f_size});
+		m_size += f_size;
+	}
+
+
+	void GatherList::addZeros(size_t f_size)
+	{
+		while(f_size)
+		{
+			auto n = std::min(f_size, sizeof(s_zeros));
+			addSpan(s_zeros, n);
+			f_size -= n;
+		}
+	}
+
+
+	void GatherList::commit()
+	{
+		auto size = m_buffer.size() - m_committed;
+		if(!size)
+			return;
+		if(!m_pieces.empty() && !m_pieces.back().data)
+			m_pieces.back().size += size;
+		else
+			m_pieces.push_back(Piece{nullptr, m_committed, size});
+		m_committed = m_buffer.size();
+		m_size += size;
+	}
+
+
+	void GatherList::clear()
+	{
+		m_pieces.clear();
+		m_buffer.clear();
+		m_committed = 0;
+		m_size = 0;
+	}
+
+
+	void GatherList::flatten(std::vector<unsigned char>& f_outStream) const
+	{
+		ASSERT(m_committed == m_buffer.size());
+		f_outStream.reserve(f_outStream.size() + m_size);
+		for(auto& piece : m_pieces)
+		{
+			auto pData = piece.data ? piece.data : &m_buffer[piece.offset];
+			f_outStream.insert(f_outStream.end(), pData, pData + piece.size);
+		}
+	}
+
+
+	bool GatherList::write(int f_fd, size_t f_offset) const
+	{
+		return writeAt(f_fd, f_offset);
+	}
+
+
+	bool GatherList::write(int f_fd) const
+	{
+		return writeAt(f_fd, -1);
+	}
+
+
+	bool GatherList::writeAt(int f_fd, long f_offset) const
+	{
+		ASSERT(m_committed == m_buffer.size());
+		std::vector<iovec> iov(m_pieces.size());
+		for(size_t i = 0; i < m_pieces.size(); ++i)
+		{
+			auto& piece = m_pieces[i];
+			iov[i].iov_base = const_cast<unsigned char*>(piece.data ? piece.data : &m_buffer[piece.offset]);
+			iov[i].iov_len = piece.size;
+		}
+
+		// Short writes continue from where they stopped
+		for(auto pIov = iov.data(), pEnd = pIov + iov.size(); pIov != pEnd;)
+		{
+			int count = std::min<long>(pEnd - pIov, IOV_MAX);
+			auto n = (f_offset == -1) ? writev(f_fd, pIov, count) : pwritev(f_fd, pIov, count, f_offset);
+			if(n == -1 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				return false;
+			if(f_offset != -1)
+				f_offset += n;
+			for(; pIov != pEnd && static_cast<size_t>(n) >= pIov->iov_len; ++pIov)
+				n -= pIov->iov_len;
+			if(n)
+			{
+				pIov->iov_base = static_cast<unsigned char*>(pIov->iov_base) + n;
+				pIov->iov_len -= n;
+			}
+		}
+		return true;
+	}
+}
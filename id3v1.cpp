@@ -1,5 +1,7 @@
 #include "id3v1.h"
 
+#include <cstring> // memcpy, memset, strnlen
+
 
 CID3v1::CID3v1(const Tag_t& f_tag):
 	m_v11		(f_tag.isV11()),
@@ -28,6 +30,15 @@ void CID3v1::serialize(std::vector<unsigned char>& f_outStream)
 	memcpy(&f_outStream[offset], m_tag.Raw, sizeof(m_tag.Raw));
 }
 
+void CID3v1::serialize(Tag::GatherList& f_outList)
+{
+	flushChanges();
+	ASSERT(!m_maskModified);
+
+	ASSERT(m_tag.isValid());
+	f_outList.addSpan(m_tag.Raw, sizeof(m_tag.Raw));
+}
+
 void CID3v1::flushChanges()
 {
 	ASSERT(!"Not tested");
@@ -96,13 +107,39 @@ namespace Tag
 
 	std::shared_ptr<IID3v1> IID3v1::create(const unsigned char* f_data, size_t f_offset, size_t f_size)
 	{
-		ASSERT(f_size == sizeof(CID3v1::Tag_t));
+		Status status;
+		auto tag = create(f_data, f_offset, f_size, status);
+		ASSERT_MSG(status.ok(), status.str());
+		return tag;
+	}
+
+	std::shared_ptr<IID3v1> IID3v1::create(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+		if(f_size < sizeof(CID3v1::Tag_t))
+			f_status = Status{Status::ErrTruncated, f_size};
+		else if(f_size > sizeof(CID3v1::Tag_t))
+			f_status = Status{Status::ErrInvalidHeader, sizeof(CID3v1::Tag_t)};
+		else if( !reinterpret_cast<const CID3v1::Tag_t*>(f_data + f_offset)->isValid() )
+			f_status = Status{Status::ErrNotFound, 0};
+		if(!f_status.ok())
+			return nullptr;
 
 		auto& tag = *reinterpret_cast<const CID3v1::Tag_t*>(f_data + f_offset);
-		ASSERT(tag.isValid());
 		return std::make_shared<CID3v1>(tag);
 	}
 
+	size_t IID3v1::getTrailingSize(const unsigned char* f_data, size_t f_end, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+		if(f_end < sizeof(CID3v1::Tag_t) || !getSize(f_data, f_end - sizeof(CID3v1::Tag_t), sizeof(CID3v1::Tag_t)))
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+		return sizeof(CID3v1::Tag_t);
+	}
+
 	// Creates an empty tag
 	std::shared_ptr<IID3v1> IID3v1::create()
 	{
@@ -115,6 +115,7 @@ public:
 	size_t getSize() const final override { return sizeof(m_tag); }
 
 	void serialize(std::vector<unsigned char>& f_outStream) final override;
+	void serialize(Tag::GatherList& f_outList) final override;
 
 private:
 	static bool isUint8(uint f_val) { return (f_val <= 0xFF); }
@@ -3,109 +3,291 @@
 #include "common.h"
 #include "frame.h"
 
+#include <algorithm>
+#include <cstddef> // offsetof
+#include <cstring> // memcpy
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+CFrameTable3::CFrameTable3(CArena& f_arena):
+	m_arena(f_arena),
+	m_slots(m_inline),
+	m_capacity(InlineSize)
+{
+	memset(m_begin, 0, sizeof(m_begin));
+	memset(m_placed, 0, sizeof(m_placed));
+}
+
+
+void CFrameTable3::reset(const uint* f_counts)
+{
+	clear();
+
+	uint total = 0;
+	for(uint i = 0; i < FrameTypeCount; ++i)
+	{
+		m_begin[i] = total;
+		total += f_counts[i];
+	}
+	reserve(total);
+	std::fill(m_slots, m_slots + total, nullptr);
+	m_begin[FrameTypeCount] = total;
+}
+
+
+void CFrameTable3::place(FrameType f_type, CFrame3* f_frame)
+{
+	ASSERT(m_placed[f_type] < count(f_type));
+	m_slots[m_begin[f_type] + m_placed[f_type]++] = f_frame;
+}
+
+
+void CFrameTable3::append(FrameType f_type, CFrame3* f_frame)
+{
+	auto n = size();
+	reserve(n + 1);
+
+	auto pos = m_begin[f_type + 1];
+	memmove(m_slots + pos + 1, m_slots + pos, (n - pos) * sizeof(*m_slots));
+	m_slots[pos] = f_frame;
+
+	for(uint i = f_type + 1; i <= FrameTypeCount; ++i)
+		++m_begin[i];
+	++m_placed[f_type];
+}
+
+
+void CFrameTable3::clear()
+{
+	for(uint i = 0, n = size(); i < n; ++i)
+	{
+		if(m_slots[i])
+			m_slots[i]->~CFrame3();
+	}
+
+	memset(m_begin, 0, sizeof(m_begin));
+	memset(m_placed, 0, sizeof(m_placed));
+
+	// The arena may recycle the memory of the array
+	m_slots = m_inline;
+	m_capacity = InlineSize;
+}
+
+
+void CFrameTable3::reserve(uint f_capacity)
+{
+	if(f_capacity <= m_capacity)
+		return;
+
+	auto capacity = std::max(f_capacity, 2 * m_capacity);
+	auto slots = static_cast<CFrame3**>(m_arena.allocate(capacity * sizeof(*m_slots), alignof(CFrame3*)));
+	memcpy(slots, m_slots, size() * sizeof(*m_slots));
+
+	m_slots = slots;
+	m_capacity = capacity;
+}
+
+// ====================================
 // Getters/Setters
 bool CID3v2::isExtendedGenre(unsigned f_index) const
 {
-	auto it = m_frames.find(FrameGenre);
-	if(it == m_frames.end())
-		throw std::out_of_range(__FUNCTION__);
+	auto frame = frame_cast<CGenreFrame3>(m_frames.get(FrameGenre, f_index));
+	frame->decode(m_diagnostics);
+	return frame->isExtended();
+}
+
 
-	auto& vec = it->second;
-	return frame_cast<CGenreFrame3>(vec.at(f_index))->isExtended();
+Tag::Picture CID3v2::getPicture(unsigned f_index) const
+{
+	auto frame = frame_cast<CPictureFrame3>(m_frames.get(FramePicture, f_index));
+	frame->decode(m_diagnostics);
+	auto data = frame->getData();
+	return Tag::Picture{static_cast<size_t>(data.data - m_data), data.size, frame->getMIME(), frame->getType(), frame->getDescription()};
 }
 
 
 std::vector<std::string> CID3v2::getUnknownFrames() const
 {
 	std::vector<std::string> names;
-	for(auto it = m_framesUnknown.cbegin(), end = m_framesUnknown.cend(); it != end; ++it)
-		names.push_back( (*it)->getId() );
+	for(uint i = 0, n = m_frames.count(FrameUnknown); i < n; ++i)
+		names.push_back( frame_cast<CRawFrame3>(m_frames.get(FrameUnknown, i))->getId() );
 	return names;
 }
 
 // ====================================
-CID3v2::CID3v2(const uchar* f_data, size_t f_offset, size_t f_size):
-	m_tag(f_size),
-	m_modified(false),
-	m_warnings(0)
+// Fields are bits indexed by frame types
+static_assert(CID3v2::FieldTrack	== 1u << FrameTrack,	"Field/FrameType mismatch");
+static_assert(CID3v2::FieldEncoded	== 1u << FrameEncoded,	"Field/FrameType mismatch");
+static_assert(CID3v2::FieldPicture	== 1u << FramePicture,	"Field/FrameType mismatch");
+static_assert(CID3v2::FieldUnknown	== 1u << FrameUnknown,	"Field/FrameType mismatch");
+
+
+CID3v2::CID3v2():
+	m_ver_minor(0),
+	m_ver_revision(0),
+	m_fields(FieldAll),
+	m_limits(Tag::Limits::none()),
+	m_frames(m_arena),
+	m_data(nullptr),
+	m_bBorrowed(false),
+	m_size(0),
+	m_framesEnd(0),
+	m_modified(false)
+{}
+
+
+CID3v2::CID3v2(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bBorrow, uint f_fields):
+	CID3v2()
 {
+	auto status = load(f_data, f_offset, f_size, f_bBorrow, f_fields);
+	ASSERT_MSG(status.ok(), status.str());
+}
+
+
+Tag::Status CID3v2::load(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bBorrow, uint f_fields)
+{
+	// Frames must be destroyed before their memory is recycled
+	m_frames.clear();
+	m_arena.reset();
+	m_fields = f_fields;
+	m_modified = false;
+
 	auto pData = f_data + f_offset;
+	m_data = pData;
+	m_bBorrowed = f_bBorrow;
+	m_size = 0;
+	m_framesEnd = 0;
+	m_diagnostics.reset(m_data);
+
+	if(f_size < sizeof(Tag_t::Header_t))
+		return Status{Status::ErrTruncated, 0};
 	auto& header = reinterpret_cast<const CID3v2::Tag_t*>(pData)->Header;
-
-	// Version
-	ASSERT(header.Version == 3 || header.Version == 4);
+	if( !header.isValid() )
+		return Status{Status::ErrInvalidHeader, 0};
+	if(sizeof(header) + header.size() > m_limits.tagSize)
+		return Status{Status::ErrLimit, offsetof(Tag_t::Header_t, SizeRaw)};
+	if(f_size < sizeof(header) + header.size())
+		return Status{Status::ErrTruncated, f_size};
+	if(f_size > sizeof(header) + header.size())
+		return Status{Status::ErrInvalidHeader, offsetof(Tag_t::Header_t, SizeRaw)};
+
+	auto status = checkSupport(header);
+	if(!status.ok())
+		return status;
 	m_ver_minor = header.Version;
 	m_ver_revision = header.Revision;
 
-	// Flags: unsynchronisation (ID3v2)
-	if(header.Flags & Tag_t::Header_t::FUnsynchronisation)
+	if(!f_bBorrow)
 	{
-		ASSERT(!"Unsynchronisation");
+		auto pTag = static_cast<uchar*>(m_arena.allocate(f_size, 1));
+		memcpy(pTag, pData, f_size);
+		m_data = pTag;
+		m_diagnostics.reset(m_data);
 	}
+	m_size = f_size;
 
-	// Flags: extended header (ID3v2.3)
-	if(header.Flags & Tag_t::Header_t::FExtendedHeader)
-	{
-		ASSERT(!"Extended header");
-	}
+	return parse();
+}
 
-	// Flags: experimental indicator (ID3v2.3)
-	if(header.Flags & Tag_t::Header_t::FExperimental)
-	{
-		ASSERT(!"Experimental indicator");
-	}
 
-	// Flags: footer present (ID3v2.4)
-	if(header.Flags & Tag_t::Header_t::FFooter)
+Tag::Status CID3v2::checkSupport(const Tag_t::Header_t& f_header)
+{
+	// Version
+	if(f_header.Version != 3 && f_header.Version != 4)
+		return Status{Status::ErrUnsupported, offsetof(Tag_t::Header_t, Version)};
+
+	// Flags: unsynchronisation (ID3v2), extended header (ID3v2.3),
+	// experimental indicator (ID3v2.3), footer present (ID3v2.4)
+	if(f_header.Flags & (Tag_t::Header_t::FUnsynchronisation	|
+						 Tag_t::Header_t::FExtendedHeader		|
+						 Tag_t::Header_t::FExperimental		|
+						 Tag_t::Header_t::FFooter))
 	{
-		ASSERT(!"Untested/unknown");
+		return Status{Status::ErrUnsupported, offsetof(Tag_t::Header_t, Flags)};
 	}
 
-	memcpy(&m_tag[0], pData, f_size);
-
-	parse();
+	return Status{Status::ErrNone, 0};
 }
 
 
-void CID3v2::parse()
+Tag::Status CID3v2::parse()
 {
 	switch(m_ver_minor)
 	{
 		case 3:
 		case 4:
-			parse3();
-			break;
+			return parse3();
 		default:
-			ASSERT_MSG(!"Unsupported ID3v2 tag version", std::to_string(m_ver_minor));
+			return Status{Status::ErrUnsupported, offsetof(Tag_t::Header_t, Version)};
 	}
 }
 
 
-static std::shared_ptr<CFrame3> createFrame(FrameType f_type, const Frame3& f_frame)
+// Frames only refer to the payload here: it is decoded on the first access
+static CFrame3* createFrame(CArena& f_arena, FrameType f_type, const Frame3& f_frame, size_t f_size)
 {
 	switch(f_type)
 	{
-		case FrameGenre:	return std::make_shared<CGenreFrame3>	(f_frame);
-		case FrameComment:	return std::make_shared<CCommentFrame3>	(f_frame);
-		case FrameMMJB:		return std::make_shared<CMMJBFrame3>	(f_frame);
-		case FrameURL:		return std::make_shared<CURLFrame3>		(f_frame);
-		case FramePicture:	return std::make_shared<CPictureFrame3>	(f_frame);
-		case FrameUnknown:	return std::make_shared<CRawFrame3>		(f_frame);
+		case FrameGenre:	return f_arena.create<CGenreFrame3>		(f_frame, f_size);
+		case FrameComment:	return f_arena.create<CCommentFrame3>	(f_frame, f_size);
+		case FrameMMJB:		return f_arena.create<CMMJBFrame3>		(f_frame, f_size);
+		case FrameURL:		return f_arena.create<CURLFrame3>		(f_frame, f_size);
+		case FramePicture:	return f_arena.create<CPictureFrame3>	(f_frame, f_size);
+		case FrameUnknown:	return f_arena.create<CRawFrame3>		(f_frame, f_size);
+
+		default:			return f_arena.create<CTextFrame3>		(f_frame, f_size);
+	}
+}
 
-		default:			return std::make_shared<CTextFrame3>	(f_frame);
+// The padding is checked at memory speed (there can be hundreds of KB of it)
+static bool isZero(const uchar* f_data, size_t f_size)
+{
+	size_t i = 0;
+#if defined(__AVX2__)
+	auto acc = _mm256_setzero_si256();
+	for(; i + 64 <= f_size; i += 64)
+	{
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f_data + i)));
+		acc = _mm256_or_si256(acc, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f_data + i + 32)));
 	}
+	if(!_mm256_testz_si256(acc, acc))
+		return false;
+#elif defined(__SSE2__)
+	auto acc = _mm_setzero_si128();
+	for(; i + 64 <= f_size; i += 64)
+	{
+		acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i + 48)));
+	}
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+		return false;
+#endif
+	uchar rest = 0;
+	for(; i < f_size; ++i)
+		rest |= f_data[i];
+	return !rest;
 }
 
-void CID3v2::parse3()
+
+Tag::Status CID3v2::scan3(FrameSpan*& f_spans, uint& f_count)
 {
-	auto& tag = *reinterpret_cast<const Tag_t*>(&m_tag[0]);
-	auto tagSize = m_tag.size();
+	auto& tag = *reinterpret_cast<const Tag_t*>(m_data);
 
 	// The size of a ID3v2 tag is limited to 256 MB
 	const uchar* pData;
 	size_t size = tag.Header.size();
-	ASSERT(tagSize == sizeof(tag.Header) + tag.Header.size());
+
+	// The table is the latest arena allocation while frames are walked, so it grows in place
+	FrameSpan* spans = nullptr;
+	uint nSpans = 0;
+	uint capacity = 0;
 
 	for(pData = static_cast<const uchar*>(tag.Frames); size >= sizeof(Frame3::Header);)
 	{
@@ -113,46 +295,41 @@ void CID3v2::parse3()
 		if(!f.Header.isValid())
 			break;
 
-		auto frameSize = f.Header.size();
-		if(sizeof(f.Header) + frameSize > size)
+		size_t offset = pData - m_data;
+		switch(CFrame3::checkFlags(f.Header))
 		{
-			WARNING("frame \"" << f.Header.str() << "\" is too large (" << frameSize << " > " << (size - sizeof(f.Header)) << ") - truncate");
-			++m_warnings;
-			frameSize = size - sizeof(f.Header);
+			case CFrame3::FlagsOK:
+				break;
+			case CFrame3::FlagsReadOnly:
+				m_diagnostics.report(Tag::Diagnostic::DiagReadOnlyFrame, f.Header.IdFourCC, pData);
+				break;
+			case CFrame3::FlagsUnsupported:
+				return Status{Status::ErrUnsupported, offset + offsetof(Frame3::Header_t, Flags)};
+			case CFrame3::FlagsInvalid:
+				return Status{Status::ErrInvalidFrame, offset + offsetof(Frame3::Header_t, Flags)};
 		}
 
-		// Get frame type
-		FrameType frameType = CFrame3::getFrameType(f.Header);
-		std::shared_ptr<CFrame3> frame;
-
-		// Create frame
-		for(auto bRetry = true; bRetry;)
+		// Before the frame is stored: the declared size, not the truncated one
+		if(!f.Header.isValidSize(m_ver_minor))
+			return Status{Status::ErrInvalidFrame, offset + offsetof(Frame3::Header_t, SizeRaw)};
+		auto frameSize = f.Header.size(m_ver_minor);
+		if(frameSize > m_limits.frameSize)
+			return Status{Status::ErrLimit, offset + offsetof(Frame3::Header_t, SizeRaw)};
+		if(nSpans == m_limits.frameCount)
+			return Status{Status::ErrLimit, offset};
+		if(sizeof(f.Header) + frameSize > size)
 		{
-			try
-			{
-				frame = createFrame(frameType, f);
-				bRetry = false;
-			}
-			catch(const CCommentFrame3::ExceptionMMJB&)
-			{
-				frameType = FrameMMJB;
-			}
+			m_diagnostics.report(Tag::Diagnostic::DiagTruncatedFrame, f.Header.IdFourCC, pData);
+			frameSize = size - sizeof(f.Header);
 		}
 
-		// Store frame
-		switch(frameType)
+		if(nSpans == capacity)
 		{
-			case FrameMMJB:
-				m_framesMMJB.push_back( frame_cast<CMMJBFrame3>(frame) );
-				break;
-
-			case FrameUnknown:
-				m_framesUnknown.push_back( frame_cast<CRawFrame3>(frame) );
-				break;
-
-			default:
-				m_frames[frameType].push_back(frame);
+			auto newCapacity = capacity ? 2 * capacity : 16;
+			spans = static_cast<FrameSpan*>(m_arena.reallocate(spans, capacity * sizeof(FrameSpan), newCapacity * sizeof(FrameSpan), alignof(FrameSpan)));
+			capacity = newCapacity;
 		}
+		spans[nSpans++] = FrameSpan{static_cast<uint>(offset), static_cast<uint>(frameSize), FrameUnknown};
 
 		// Next
 		pData += sizeof(f.Header) + frameSize;
@@ -160,54 +337,274 @@ void CID3v2::parse3()
 	}
 
 	// Validate tail
-	for(; size; --size, ++pData)
-		ASSERT(*pData == 0x00);
+	if(!isZero(pData, size))
+		return Status{Status::ErrInvalidPadding, static_cast<size_t>(pData - m_data)};
+
+	m_framesEnd = pData - m_data;
+	f_spans = spans;
+	f_count = nSpans;
+	return Status{Status::ErrNone, 0};
 }
 
 
-void CID3v2::serialize(std::vector<uchar>& f_outStream)
+Tag::Status CID3v2::parse3()
 {
-	ASSERT(!m_modified);
-	ASSERT(!m_warnings);
-	f_outStream.insert(f_outStream.end(), m_tag.begin(), m_tag.end());
+	FrameSpan* spans;
+	uint nSpans;
+	auto status = scan3(spans, nSpans);
+	if(!status.ok())
+		return status;
+
+	// Get frame types (unselected frames are dropped after the header checks)
+	uint nSelected = 0;
+	uint counts[FrameTypeCount] = {};
+	for(uint i = 0; i < nSpans; ++i)
+	{
+		auto& f = *reinterpret_cast<const Frame3*>(m_data + spans[i].Offset);
+
+		FrameType frameType = CFrame3::getFrameType(f.Header);
+		if(!isSelected(frameType))
+			continue;
+		// Unselected frames are never decoded
+		if(CFrame3::isText(frameType) && spans[i].Size > m_limits.textSize)
+			return Status{Status::ErrLimit, spans[i].Offset + offsetof(Frame3::Header_t, SizeRaw)};
+		if(frameType == FrameComment && CCommentFrame3::isMMJB(f, spans[i].Size))
+			frameType = FrameMMJB;
+
+		spans[i].Type = frameType;
+		spans[nSelected++] = spans[i];
+		++counts[frameType];
+	}
+
+	// Create frames grouped by type (the order of frames of the same type is kept)
+	m_frames.reset(counts);
+	for(uint i = 0; i < nSelected; ++i)
+	{
+		auto& f = *reinterpret_cast<const Frame3*>(m_data + spans[i].Offset);
+		m_frames.place(spans[i].Type, createFrame(m_arena, spans[i].Type, f, spans[i].Size));
+	}
+
+	return status;
+}
+
+
+// The operations of Tag::GatherList on a vector (everything is copied)
+class CVectorList
+{
+public:
+	explicit CVectorList(std::vector<uchar>& f_out): m_out(f_out) {}
+
+	void addSpan(const uchar* f_data, size_t f_size) { m_out.insert(m_out.end(), f_data, f_data + f_size); }
+	void addZeros(size_t f_size) { m_out.resize(m_out.size() + f_size, 0); }
+	std::vector<uchar>& getBuffer() { return m_out; }
+	void commit() {}
+	size_t getSize() const { return m_out.size(); }
+
+private:
+	std::vector<uchar>& m_out;
+};
+
+
+template<typename T_List>
+size_t CID3v2::serializeTo(T_List& f_outList, size_t f_size, const Tag::IPaddingPolicy* f_policy, bool f_bOverwrite)
+{
+	ASSERT(!m_diagnostics.hasIssues());
+	if(!m_modified && f_size == m_size)
+	{
+		f_outList.addSpan(m_data, m_size);
+		return m_framesEnd;
+	}
+
+	// Modified frames in the order of the tag, then the new ones
+	struct Change
+	{
+		size_t			Offset;
+		FrameType		Type;
+		const CFrame3*	Frame;
+	};
+	std::vector<Change> changes;
+	for(uint type = 0; type < FrameTypeCount; ++type)
+	{
+		for(uint i = 0, n = m_frames.count(FrameType(type)); i < n; ++i)
+		{
+			auto frame = m_frames.get(FrameType(type), i);
+			if(!frame->isModified())
+				continue;
+			auto original = frame->getOriginal();
+			changes.push_back(Change{original ? static_cast<size_t>(reinterpret_cast<const uchar*>(original) - m_data) : m_size, FrameType(type), frame});
+		}
+	}
+	std::stable_sort(changes.begin(), changes.end(), [](const Change& f_a, const Change& f_b){ return f_a.Offset < f_b.Offset; });
+
+	// The header is copied (the size is set at the end), unmodified ranges
+	// up to the padding are not
+	auto begin = f_outList.getSize();
+	auto& buffer = f_outList.getBuffer();
+	auto header = buffer.size();
+	buffer.insert(buffer.end(), m_data, m_data + sizeof(Tag_t::Header_t));
+	f_outList.commit();
+	bool bAliased = f_bOverwrite && m_bBorrowed;
+	auto copy = [&](size_t f_from, size_t f_to)
+	{
+		// A range written where it is read from holds the same bytes either way
+		if(bAliased && f_outList.getSize() - begin != f_from)
+		{
+			buffer.insert(buffer.end(), m_data + f_from, m_data + f_to);
+			f_outList.commit();
+		}
+		else
+			f_outList.addSpan(m_data + f_from, f_to - f_from);
+	};
+
+	size_t from = sizeof(Tag_t::Header_t);
+	for(auto& change : changes)
+	{
+		auto original = change.Frame->getOriginal();
+		if(!original)
+			break;
+		copy(from, change.Offset);
+		change.Frame->encode(original->Header.IdFourCC, m_ver_minor, buffer);
+		f_outList.commit();
+		from = change.Offset + sizeof(original->Header) + original->Header.size(m_ver_minor);
+	}
+	copy(from, m_framesEnd);
+
+	for(auto& change : changes)
+	{
+		if(!change.Frame->getOriginal())
+			change.Frame->encode(CFrame3::getFrameId(change.Type), m_ver_minor, buffer);
+	}
+	f_outList.commit();
+
+	// The padding takes up the rest
+	auto framesSize = f_outList.getSize() - begin;
+	auto size = (framesSize > f_size && f_policy) ? f_policy->getTagSize(framesSize) : f_size;
+	ASSERT(size >= f_size);
+	if(size > framesSize)
+		f_outList.addZeros(size - framesSize);
+	else
+		size = framesSize;
+
+	auto pSize = &buffer[header + offsetof(Tag_t::Header_t, SizeRaw)];
+	size -= sizeof(Tag_t::Header_t);
+	ASSERT_MSG(size < (1u << 28), "The tag is over 256 MB");
+	for(uint i = 0; i < 4; ++i)
+		pSize[i] = (size >> (21 - 7 * i)) & 0x7F;
+	return framesSize;
+}
+
+
+size_t CID3v2::serialize(std::vector<uchar>& f_outStream, size_t f_size, const Tag::IPaddingPolicy* f_policy)
+{
+	f_outStream.reserve(f_outStream.size() + std::max(f_size, m_size));
+	CVectorList list(f_outStream);
+	return serializeTo(list, f_size, f_policy, false);
+}
+
+
+size_t CID3v2::serialize(Tag::GatherList& f_outList, size_t f_size, const Tag::IPaddingPolicy* f_policy, bool f_bOverwrite)
+{
+	return serializeTo(f_outList, f_size, f_policy, f_bOverwrite);
+}
+
+
+void CID3v2::reload(const Tag::GatherList& f_written)
+{
+	std::vector<uchar> data;
+	f_written.flatten(data);
+
+	// The tag was just serialized from this one: limits do not apply
+	auto limits = m_limits;
+	m_limits = Tag::Limits::none();
+	auto status = load(data.data(), 0, data.size(), false, m_fields);
+	m_limits = limits;
+	ASSERT_MSG(status.ok(), status.str());
 }
 
 // ====================================
 namespace Tag
 {
-	size_t IID3v2::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size)
+	size_t IID3v2::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status)
 	{
-		if(f_size < sizeof(CID3v2::Tag_t::Header_t))
+		Probe probe;
+		auto tagSize = IID3v2::probe(f_data, f_offset, f_size, probe, f_status);
+		if(!tagSize)
 			return 0;
-		auto pData = f_data + f_offset;
 
-		auto& tag = *reinterpret_cast<const CID3v2::Tag_t*>(pData);
-		if( !tag.Header.isValid() )
-			return 0;
-
-		auto tagSize = tag.getSize();
 		if(f_size < tagSize)
+		{
+			f_status = Status{Status::ErrTruncated, f_size};
 			return 0;
+		}
 
-		if(tag.Header.hasFooter())
+		if(probe.flags & CID3v2::Tag_t::Header_t::FFooter)
 		{
-			auto& footer = *reinterpret_cast<const CID3v2::Tag_t::Header_t*>(pData + sizeof(tag.Header) + tag.Header.size());
-			ASSERT(!"Requires verification");
-			// tag.Header ??? (should be footer)
-			if( !footer.isValidFooter(tag.Header) )
-			{
-				ASSERT(!"Invalid ID3v2 tag footer");
-				return 0;
-			}
+			// Requires verification
+			f_status = Status{Status::ErrUnsupported, tagSize - sizeof(CID3v2::Tag_t::Header_t)};
+			return 0;
 		}
 
 		return tagSize;
 	}
 
+	size_t IID3v2::probeSize()
+	{
+		return sizeof(CID3v2::Tag_t::Header_t);
+	}
+
+	size_t IID3v2::probe(const unsigned char* f_data, size_t f_offset, size_t f_size, Probe& f_probe, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+		f_probe = Probe{0, 0, 0};
+
+		// f_data may be nullptr when f_size is 0
+		if(f_size < sizeof(CID3v2::Tag_t::Header_t))
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+		auto& tag = *reinterpret_cast<const CID3v2::Tag_t*>(f_data + f_offset);
+		if(!tag.Header.isValid())
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+
+		f_probe = Probe{tag.Header.Version, tag.Header.Flags, tag.getSize()};
+		return f_probe.size;
+	}
+
+	size_t IID3v2::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size)
+	{
+		Status status;
+		auto size = getSize(f_data, f_offset, f_size, status);
+		ASSERT_MSG(status.ok() || status.isAbsent(), status.str());
+		return size;
+	}
+
+
+	std::shared_ptr<IID3v2> IID3v2::create(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields)
+	{
+		return std::make_shared<CID3v2>(f_data, f_offset, f_size, false, f_fields);
+	}
+
+	std::shared_ptr<IID3v2> IID3v2::create(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status, unsigned f_fields)
+	{
+		auto tag = std::make_shared<CID3v2>();
+		f_status = tag->load(f_data, f_offset, f_size, false, f_fields);
+		return f_status.ok() ? tag : nullptr;
+	}
+
+	std::shared_ptr<IID3v2> IID3v2::createBorrowed(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields)
+	{
+		return std::make_shared<CID3v2>(f_data, f_offset, f_size, true, f_fields);
+	}
 
-	std::shared_ptr<IID3v2> IID3v2::create(const unsigned char* f_data, size_t f_offset, size_t f_size)
+	std::shared_ptr<IID3v2> IID3v2::createBorrowed(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status, unsigned f_fields)
 	{
-		return std::make_shared<CID3v2>(f_data, f_offset, f_size);
+		auto tag = std::make_shared<CID3v2>();
+		f_status = tag->load(f_data, f_offset, f_size, true, f_fields);
+		return f_status.ok() ? tag : nullptr;
 	}
 
 	// Creates an empty tag
@@ -234,7 +631,7 @@ namespace Tag
 		ASSERT(tag.Header.isValid());
 
 		ASSERT(!"Check if size correct");
-		return std::make_shared<CID3v2>(reinterpret_cast<uchar*>(&tag), 0, tag.getSize());
+		return std::make_shared<CID3v2>(reinterpret_cast<uchar*>(&tag), 0, tag.getSize(), false);
 	}
 }
 
@@ -2,11 +2,57 @@
 
 #include "tag.h"
 #include "frame.h"
+#include "arena.h"
 
 #include "common.h"
 
 #include <vector>
-#include <unordered_map>
+
+
+// Frames of all types in one array, grouped by type: the frames of the type T
+// are [m_begin[T], m_begin[T + 1]). Small tags fit into the inline array.
+// Frames and the array itself are allocated from the arena.
+class CFrameTable3
+{
+public:
+	explicit CFrameTable3(CArena& f_arena);
+	~CFrameTable3() { clear(); }
+	CFrameTable3(const CFrameTable3&) = delete;
+	CFrameTable3& operator=(const CFrameTable3&) = delete;
+
+	uint		size	() const					{ return m_begin[FrameTypeCount]; }
+	uint		count	(FrameType f_type) const	{ return m_begin[f_type + 1] - m_begin[f_type]; }
+	CFrame3*	get		(FrameType f_type, uint f_index) const
+	{
+		if(f_index >= count(f_type))
+			throw std::out_of_range(__FUNCTION__);
+		return m_slots[m_begin[f_type] + f_index];
+	}
+
+	// Deletes all frames and lays out f_counts[type] empty slots for every type
+	void		reset	(const uint* f_counts);
+	// Fills the next empty slot of the type (the table destroys the frame)
+	void		place	(FrameType f_type, CFrame3* f_frame);
+	// Inserts a frame after the last one of the same type (the table destroys the frame)
+	void		append	(FrameType f_type, CFrame3* f_frame);
+	// Destroys frames (the arena keeps their memory)
+	void		clear	();
+
+private:
+	void		reserve	(uint f_capacity);
+
+private:
+	enum { InlineSize = 16 };
+
+	CArena&		m_arena;
+
+	uint		m_begin[FrameTypeCount + 1];
+	uint		m_placed[FrameTypeCount];
+
+	CFrame3**	m_slots;
+	uint		m_capacity;
+	CFrame3*	m_inline[InlineSize];
+};
 
 
 class CID3v2 final : public Tag::IID3v2
@@ -90,37 +136,43 @@ public:
 
 	// ================================
 public:
-	CID3v2(const uchar* f_data, size_t f_offset, size_t f_size);
-	CID3v2() = delete;
+	// When f_bBorrow is set, f_data is not copied and must outlive the object
+	CID3v2(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bBorrow, uint f_fields = FieldAll);
+	// An empty object to load() tags into
+	CID3v2();
+	// Frames point into the tag buffer
+	CID3v2(const CID3v2&) = delete;
+	CID3v2& operator=(const CID3v2&) = delete;
 
 	// Getters/Setters
 	unsigned getMinorVersion() const final override { return m_ver_minor; }
 	unsigned getRevision() const final override { return m_ver_revision; }
 
 #define DEF_COUNT_GETTER(Name) \
-	unsigned get##Name##Count() const final override \
-	{ \
-		auto it = m_frames.find(Frame##Name); \
-		return (it == m_frames.cend()) ? 0 : it->second.size(); \
-	}
+	unsigned get##Name##Count() const final override { return m_frames.count(Frame##Name); }
 #define DEF_GETTER(Name, FrameType, Method, ValType) \
 	ValType get##Name(unsigned f_index) const final override \
 	{ \
-		auto it = m_frames.find(Frame##Name); \
-		if(it == m_frames.cend()) \
-			throw std::out_of_range(__FUNCTION__); \
-		auto& vec = it->second; \
-		return frame_cast<FrameType>(vec.at(f_index))->Method(); \
+		auto frame = frame_cast<FrameType>(m_frames.get(Frame##Name, f_index)); \
+		frame->decode(m_diagnostics); \
+		return frame->Method(); \
 	}
 #define DEF_SETTER(Name, FrameType, Method, ValType) \
 	void set##Name(unsigned f_index, ValType f_val) final override \
 	{ \
-		ASSERT(!"Untested"); \
-		auto& vec = m_frames[Frame##Name]; \
-		if(f_index == vec.size()) \
-			vec.emplace_back( std::make_shared<FrameType>(f_val) ); \
-		else if(f_index < vec.size()) \
-			frame_cast<FrameType>(vec[f_index])->Method(f_val); \
+		/* Unselected frames would be serialized as well */ \
+		ASSERT(isSelected(Frame##Name)); \
+		auto count = m_frames.count(Frame##Name); \
+		if(f_index == count) \
+		{ \
+			m_frames.append(Frame##Name, m_arena.create<FrameType>(f_val)); \
+		} \
+		else if(f_index < count) \
+		{ \
+			auto frame = frame_cast<FrameType>(m_frames.get(Frame##Name, f_index)); \
+			frame->decode(m_diagnostics); \
+			frame->Method(f_val); \
+		} \
 		else \
 			throw std::out_of_range(__FUNCTION__); \
 		m_modified = true; \
@@ -160,10 +212,11 @@ public:
 	#define FramePictureData FramePicture
 	#define FramePictureDescription FramePicture
 	DEF_COUNT_GETTER				(Picture)
-	DEF_GETTER						(PictureData, CPictureFrame3, getData, const std::vector<uchar>&)
+	DEF_GETTER						(PictureData, CPictureFrame3, getData, Tag::Span)
 	DEF_GETTER						(PictureDescription, CPictureFrame3, getDescription, const std::string&)
 	#undef FramePictureDescription
 	#undef FramePictureData
+	Tag::Picture getPicture(unsigned f_index) const final override;
 #undef DEF_GETTER_SETTER_TEXT
 #undef DEF_GETTER_SETTER_TEXT_GENERAL
 #undef DEF_SETTER
@@ -175,44 +228,101 @@ public:
 	size_t getSize() const final override
 	{
 		ASSERT(!m_modified);
-		return m_tag.size();
+		return m_size;
 	}
+	// Of the parsed (or last saved) tag
+	size_t getPaddingSize() const final override { return m_size - m_framesEnd; }
+
+	bool hasIssues() const final override { return m_diagnostics.hasIssues(); }
+	unsigned getDiagnosticCount() const final override { return m_diagnostics.count(); }
+	const Tag::Diagnostic& getDiagnostic(unsigned f_index) const final override { return m_diagnostics.get(f_index); }
+
+	// Unmodified frames and the bytes between them are copied as they are;
+	// modified and new frames are encoded (the new ones go last). The tag
+	// keeps its size while the frames fit into it.
+	void serialize(std::vector<uchar>& f_outStream) final override { serialize(f_outStream, m_size); }
+	void serialize(Tag::GatherList& f_outList) final override { serialize(f_outList, m_size); }
+	void serialize(std::vector<uchar>& f_outStream, const Tag::IPaddingPolicy& f_policy) final override { serialize(f_outStream, 0, &f_policy); }
+	// Padded to f_size bytes if the frames fit, otherwise as f_policy chooses
+	// (no padding without one). Returns the size of the header and frames.
+	size_t serialize(std::vector<uchar>& f_outStream, size_t f_size, const Tag::IPaddingPolicy* f_policy = nullptr);
+	// With f_bOverwrite the list is to be written over the tag's own slot
+	// in the file it was read from, which a borrowed buffer may map: the
+	// ranges that move are copied into the list, not read while written.
+	size_t serialize(Tag::GatherList& f_outList, size_t f_size, const Tag::IPaddingPolicy* f_policy = nullptr, bool f_bOverwrite = false);
+	// The header and frames of the parsed (or last saved) tag
+	size_t getFramesSize() const { return m_framesEnd; }
+	// After a save: the tag becomes the one written, as an owned copy (a
+	// borrowed buffer may map the slot just overwritten)
+	void reload(const Tag::GatherList& f_written);
+
+	void setDiagnosticSink(Tag::IDiagnosticSink* f_sink) { m_diagnostics.setSink(f_sink); }
+	// For the following loads
+	void setLimits(const Tag::Limits& f_limits) { m_limits = f_limits; }
+
+	// The version and the header flags (the header is expected to be valid)
+	static Tag::Status checkSupport(const Tag_t::Header_t& f_header);
+
+	// Replaces the content with another tag, reusing the frame storage
+	// (the object is empty unless the result is OK)
+	Tag::Status load(const uchar* f_data, size_t f_offset, size_t f_size, bool f_bBorrow, uint f_fields = FieldAll);
 
-	bool hasIssues() const final override { return m_warnings; }
+private:
+	// For a vector and for a Tag::GatherList
+	template<typename T_List>
+	size_t serializeTo(T_List& f_outList, size_t f_size, const Tag::IPaddingPolicy* f_policy, bool f_bOverwrite);
 
-	void serialize(std::vector<uchar>& f_outStream) final override;
+	// Frame boundaries found by scan3()
+	struct FrameSpan
+	{
+		uint		Offset;	// Of the frame header, from the beginning of the tag
+		uint		Size;	// Of the payload (truncated to the tag)
+		FrameType	Type;
+	};
 
-private:
-	void parse();
-	void parse3();
+	using Status = Tag::Status;
+
+	Status parse();
+	Status parse3();
+	// Structural pre-scan: walks frame headers into a compact offset table
+	// (in the arena) and validates the padding
+	Status scan3(FrameSpan*& f_spans, uint& f_count);
 
-	template<typename T_To, typename T_From>
-	static std::shared_ptr<T_To> frame_cast(const std::shared_ptr<T_From>& f_frame)
+	// MusicMatch frames go with comments
+	bool isSelected(FrameType f_type) const
 	{
-		return std::static_pointer_cast<T_To>(f_frame);
+		return m_fields & (1u << (f_type == FrameMMJB ? FrameComment : f_type));
 	}
 
-private:
-	template<typename T>
-	struct EnumHasher
+	template<typename T_To>
+	static T_To* frame_cast(CFrame3* f_frame)
 	{
-		unsigned operator()(const T& f_key) const { return static_cast<unsigned>(f_key); }
-	};
-	using frames_t = std::unordered_map<FrameType, std::vector<std::shared_ptr<CFrame3>>, EnumHasher<FrameType>>;
+		return static_cast<T_To*>(f_frame);
+	}
 
 private:
 	uint										m_ver_minor;
 	uint										m_ver_revision;
 
-	frames_t									m_frames;
-	std::vector<std::shared_ptr<CMMJBFrame3>>	m_framesMMJB;
-	std::vector<std::shared_ptr<CRawFrame3>>	m_framesUnknown;
-
-	// A raw tag
-	std::vector<uchar>							m_tag;
-	// A temporary flag for simplicity
+	// IID3v2::Field mask
+	uint										m_fields;
+	Tag::Limits									m_limits;
+
+	// Frames, the frame index and the raw tag copy (must outlive m_frames)
+	CArena										m_arena;
+	// Includes MMJB and unknown frames
+	CFrameTable3								m_frames;
+
+	// A raw tag: either a copy in the arena or a borrowed buffer
+	const uchar*								m_data;
+	bool										m_bBorrowed;
+	size_t										m_size;
+	// The end of the last frame (the padding follows)
+	size_t										m_framesEnd;
+	// A frame has been set (see CFrame3::isModified)
 	bool										m_modified;
 
-	uint										m_warnings;
+	// Lazy decoding reports from const getters
+	mutable CDiagnostics						m_diagnostics;
 };
 
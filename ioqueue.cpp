@@ -0,0 +1,300 @@
+#include "ioqueue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TAG_IO_URING
+#endif
+#endif
+
+#if defined(TAG_IO_URING)
+#include <cstring> // memset
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+
+#if defined(TAG_IO_URING)
+// Raw system calls (no liburing)
+class CIOUring : public CIOQueue
+{
+public:
+	// nullptr if io_uring or IORING_OP_READ is not available
+	static std::unique_ptr<CIOQueue> create(uint f_depth);
+	~CIOUring();
+
+	bool isIOUring() const final override { return true; }
+
+	void submit(Request* f_request) final override;
+	void wait(std::vector<Request*>& f_completed) final override;
+
+private:
+	CIOUring();
+	bool init(uint f_depth);
+
+	template<typename T>
+	T* ring(void* f_ring, uint f_offset) { return reinterpret_cast<T*>(static_cast<char*>(f_ring) + f_offset); }
+
+private:
+	int				m_fd;
+
+	void*			m_sqRing;
+	size_t			m_sqRingSize;
+	void*			m_cqRing;
+	size_t			m_cqRingSize;
+	io_uring_sqe*	m_sqes;
+	size_t			m_sqesSize;
+
+	uint*			m_sqTail;
+	uint			m_sqMask;
+	uint*			m_sqArray;
+	uint*			m_cqHead;
+	uint*			m_cqTail;
+	uint			m_cqMask;
+	io_uring_cqe*	m_cqes;
+
+	// Queued but not passed to the kernel yet
+	uint			m_toSubmit;
+};
+
+
+CIOUring::CIOUring():
+	m_fd(-1),
+	m_sqRing(MAP_FAILED),
+	m_sqRingSize(0),
+	m_cqRing(MAP_FAILED),
+	m_cqRingSize(0),
+	m_sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+	m_sqesSize(0),
+	m_toSubmit(0)
+{}
+
+
+CIOUring::~CIOUring()
+{
+	if(m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+	if(m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	if(m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingSize);
+	if(m_fd != -1)
+		close(m_fd);
+}
+
+
+std::unique_ptr<CIOQueue> CIOUring::create(uint f_depth)
+{
+	std::unique_ptr<CIOUring> queue(new CIOUring());
+	if(!queue->init(f_depth))
+		return nullptr;
+	return std::unique_ptr<CIOQueue>(queue.release());
+}
+
+
+bool CIOUring::init(uint f_depth)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	m_fd = syscall(__NR_io_uring_setup, f_depth, &params);
+	if(m_fd == -1)
+		return false;
+
+	// IORING_OP_READ appeared later than io_uring itself
+	alignas(io_uring_probe) uchar buffer[sizeof(io_uring_probe) + (IORING_OP_READ + 1) * sizeof(io_uring_probe_op)];
+	memset(buffer, 0, sizeof(buffer));
+	auto& probe = *reinterpret_cast<io_uring_probe*>(buffer);
+	if(syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, &probe, IORING_OP_READ + 1) == -1 ||
+	   probe.last_op < IORING_OP_READ ||
+	   !(probe.ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+	{
+		return false;
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if(m_sqRing == MAP_FAILED)
+		return false;
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		m_cqRing = m_sqRing;
+	else
+	{
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		if(m_cqRing == MAP_FAILED)
+			return false;
+	}
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+	if(m_sqes == MAP_FAILED)
+		return false;
+
+	m_sqTail	= ring<uint>(m_sqRing, params.sq_off.tail);
+	m_sqMask	= *ring<uint>(m_sqRing, params.sq_off.ring_mask);
+	m_sqArray	= ring<uint>(m_sqRing, params.sq_off.array);
+	m_cqHead	= ring<uint>(m_cqRing, params.cq_off.head);
+	m_cqTail	= ring<uint>(m_cqRing, params.cq_off.tail);
+	m_cqMask	= *ring<uint>(m_cqRing, params.cq_off.ring_mask);
+	m_cqes		= ring<io_uring_cqe>(m_cqRing, params.cq_off.cqes);
+	return true;
+}
+
+
+void CIOUring::submit(Request* f_request)
+{
+	// Only this thread writes the tail
+	auto tail = *m_sqTail;
+	auto index = tail & m_sqMask;
+
+	auto& sqe = m_sqes[index];
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_READ;
+	sqe.fd = f_request->Fd;
+	sqe.addr = reinterpret_cast<uintptr_t>(f_request->Buffer);
+	sqe.len = f_request->Size;
+	sqe.off = f_request->Offset;
+	sqe.user_data = reinterpret_cast<uintptr_t>(f_request);
+
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	++m_toSubmit;
+}
+
+
+void CIOUring::wait(std::vector<Request*>& f_completed)
+{
+	for(;;)
+	{
+		auto n = syscall(__NR_io_uring_enter, m_fd, m_toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if(n >= 0)
+		{
+			m_toSubmit -= n;
+			break;
+		}
+		ASSERT_MSG(errno == EINTR || errno == EAGAIN || errno == EBUSY, "io_uring_enter failed");
+	}
+
+	auto head = *m_cqHead;
+	for(auto tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE); head != tail; ++head)
+	{
+		auto& cqe = m_cqes[head & m_cqMask];
+		auto request = reinterpret_cast<Request*>(static_cast<uintptr_t>(cqe.user_data));
+		request->Result = cqe.res;
+		f_completed.push_back(request);
+	}
+	__atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// ============================================================================
+class CThreadIO : public CIOQueue
+{
+public:
+	explicit CThreadIO(uint f_threads);
+	~CThreadIO();
+
+	bool isIOUring() const final override { return false; }
+
+	void submit(Request* f_request) final override { m_toSubmit.push_back(f_request); }
+	void wait(std::vector<Request*>& f_completed) final override;
+
+private:
+	void run();
+
+private:
+	std::vector<std::thread>	m_threads;
+
+	std::mutex					m_mutex;
+	std::condition_variable		m_queued;
+	std::condition_variable		m_completed;
+	std::deque<Request*>		m_queue;
+	std::vector<Request*>		m_done;
+	bool						m_stop;
+
+	// Queued on the submitting thread (without locking)
+	std::vector<Request*>		m_toSubmit;
+};
+
+
+CThreadIO::CThreadIO(uint f_threads):
+	m_stop(false)
+{
+	for(uint i = 0; i < f_threads; ++i)
+		m_threads.emplace_back(&CThreadIO::run, this);
+}
+
+
+CThreadIO::~CThreadIO()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_queued.notify_all();
+	for(auto& thread : m_threads)
+		thread.join();
+}
+
+
+void CThreadIO::wait(std::vector<Request*>& f_completed)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if(!m_toSubmit.empty())
+	{
+		m_queue.insert(m_queue.end(), m_toSubmit.begin(), m_toSubmit.end());
+		m_toSubmit.clear();
+		m_queued.notify_all();
+	}
+
+	m_completed.wait(lock, [this]{ return !m_done.empty(); });
+	f_completed.insert(f_completed.end(), m_done.begin(), m_done.end());
+	m_done.clear();
+}
+
+
+void CThreadIO::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for(;;)
+	{
+		m_queued.wait(lock, [this]{ return m_stop || !m_queue.empty(); });
+		if(m_stop)
+			return;
+
+		auto request = m_queue.front();
+		m_queue.pop_front();
+		lock.unlock();
+
+		long n;
+		do
+			n = pread(request->Fd, request->Buffer, request->Size, request->Offset);
+		while(n == -1 && errno == EINTR);
+		request->Result = (n == -1) ? -errno : n;
+
+		lock.lock();
+		m_done.push_back(request);
+		m_completed.notify_one();
+	}
+}
+
+// ============================================================================
+std::unique_ptr<CIOQueue> CIOQueue::create(uint f_depth)
+{
+#if defined(TAG_IO_URING)
+	if(auto queue = CIOUring::create(f_depth))
+		return queue;
+#endif
+	// Reads block the threads, so there are more of them than cores
+	return std::unique_ptr<CIOQueue>(new CThreadIO(std::max(1u, std::min(f_depth, 32u))));
+}
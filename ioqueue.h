@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.h"
+
+#include <memory>
+#include <vector>
+
+
+// Asynchronous reads: requests are queued, submitted in batches and
+// completed in any order (io_uring, or a pool of threads with pread)
+class CIOQueue
+{
+public:
+	struct Request
+	{
+		int		Fd;
+		uchar*	Buffer;
+		size_t	Size;
+		size_t	Offset;
+		void*	User;
+		// Bytes read or -errno
+		long	Result;
+	};
+
+	// Falls back to threads if io_uring is not available
+	static std::unique_ptr<CIOQueue> create(uint f_depth);
+
+	virtual bool isIOUring() const = 0;
+
+	// At most f_depth requests may be pending
+	virtual void submit(Request* f_request) = 0;
+	// Submits the queued requests and waits for at least one to complete
+	// (appended to f_completed); there must be some pending
+	virtual void wait(std::vector<Request*>& f_completed) = 0;
+
+	virtual ~CIOQueue() {}
+};
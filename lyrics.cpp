@@ -2,9 +2,14 @@
 
 #include "common.h"
 
-#include <cstring> // memcpy
+#include <algorithm>
+#include <cstring> // memcmp, memcpy
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 struct __attribute__ ((__packed__)) Header_t
 {
@@ -30,14 +35,94 @@ struct __attribute__ ((__packed__)) Footer_t
 		uint	uId[2];
 	};
 
-	bool isValid() const
+	bool isValid() const { return isV1() || isV2(); }
+
+	// "LYRICSEND"
+	bool isV1() const { return (uId[0] == FOUR_CC('L','Y','R','I') && uId[1] == FOUR_CC('C','S','E','N') && cId[8] == 'D'); }
+	// "LYRICS200" (preceded by the size field)
+	bool isV2() const { return (uId[0] == FOUR_CC('L','Y','R','I') && uId[1] == FOUR_CC('C','S','2','0') && cId[8] == '0'); }
+};
+
+// Lyrics3v2: the size of the tag from the header up to the size field
+struct __attribute__ ((__packed__)) SizeField_t
+{
+	char Digits[6];
+
+	bool get(size_t& f_size) const
 	{
-		return (uId[0] == FOUR_CC('L','Y','R','I') &&
-			  ((uId[1] == FOUR_CC('C','S','E','N') && cId[8] == 'D') ||
-			   (uId[1] == FOUR_CC('C','S','2','0') && cId[8] == '0')));
+		f_size = 0;
+		for(auto c : Digits)
+		{
+			if(c < '0' || c > '9')
+				return false;
+			f_size = f_size * 10 + (c - '0');
+		}
+		return true;
 	}
 };
 
+// Lyrics3v2 field: "ID" (3 capital letters), size (5 digits) and data
+struct __attribute__ ((__packed__)) Field_t
+{
+	char Id[3];
+	char Digits[5];
+
+	bool get(size_t& f_size) const
+	{
+		for(auto c : Id)
+		{
+			if(c < 'A' || c > 'Z')
+				return false;
+		}
+		f_size = 0;
+		for(auto c : Digits)
+		{
+			if(c < '0' || c > '9')
+				return false;
+			f_size = f_size * 10 + (c - '0');
+		}
+		return true;
+	}
+};
+
+// Lyrics3v1: the text is limited to 5100 characters
+static const size_t s_maxSizeV1 = sizeof(Header_t) + 5100 + sizeof(Footer_t);
+
+// Returns the offset of the first f_id (f_idSize >= 2 bytes) or f_size if there is none.
+// The first and the last bytes of the ID are matched a block at a time.
+static size_t find(const uchar* f_data, size_t f_size, const char* f_id, size_t f_idSize)
+{
+	if(f_size < f_idSize)
+		return f_size;
+	auto n = f_size - f_idSize + 1;
+
+	size_t i = 0;
+#if defined(__SSE2__)
+	auto first = _mm_set1_epi8(f_id[0]);
+	auto last = _mm_set1_epi8(f_id[f_idSize - 1]);
+	for(; i + 16 <= n; i += 16)
+	{
+		auto vFirst = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i));
+		auto vLast = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i + f_idSize - 1));
+		for(uint mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(vFirst, first), _mm_cmpeq_epi8(vLast, last))); mask; mask &= mask - 1)
+		{
+			auto pos = i + __builtin_ctz(mask);
+			if(!memcmp(f_data + pos + 1, f_id + 1, f_idSize - 2))
+				return pos;
+		}
+	}
+#endif
+	for(; i < n; ++i)
+	{
+		if(f_data[i] == static_cast<uchar>(f_id[0]) && !memcmp(f_data + i + 1, f_id + 1, f_idSize - 1))
+			return i;
+	}
+	return f_size;
+}
+
+static const char s_idHeader[] = "LYRICSBEGIN";
+static const char s_idFooterV1[] = "LYRICSEND";
+
 // ====================================
 class CLyrics : public Tag::ILyrics
 {
@@ -52,6 +137,10 @@ public:
 	{
 		f_outStream.insert(f_outStream.end(), m_tag.begin(), m_tag.end());
 	}
+	void serialize(Tag::GatherList& f_outList) final override
+	{
+		f_outList.addSpan(m_tag.data(), m_tag.size());
+	}
 
 	size_t getSize() const final override { return m_tag.size(); }
 
@@ -64,30 +153,173 @@ namespace Tag
 {
 	size_t ILyrics::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size)
 	{
+		Status status;
+		auto size = getSize(f_data, f_offset, f_size, status);
+		ASSERT_MSG(status.ok() || status.isAbsent(), status.str());
+		return size;
+	}
+
+	size_t ILyrics::getSize(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
 		auto pData = f_data + f_offset;
 
 		// Check header
 		auto& h = *reinterpret_cast<const Header_t*>(pData);
 		if(sizeof(h) > f_size || !h.isValid())
+		{
+			f_status.error = Status::ErrNotFound;
 			return 0;
+		}
 		auto size = f_size - sizeof(h);
 
-		// Search for the footer
-		if(size < sizeof(Footer_t))
-			return 0;
+		// Lyrics3v2 anchored by the size field at the end of the data (the usual
+		// case when called for a located tag)
+		size_t tagSize;
+		if(size >= sizeof(SizeField_t) + sizeof(Footer_t))
+		{
+			auto& f = *reinterpret_cast<const Footer_t*>(pData + f_size - sizeof(Footer_t));
+			auto& s = *reinterpret_cast<const SizeField_t*>(pData + f_size - sizeof(Footer_t) - sizeof(SizeField_t));
+			if(f.isV2() && s.get(tagSize) && tagSize + sizeof(s) + sizeof(f) == f_size)
+				return f_size;
+		}
 
-		auto p = pData + sizeof(h);
-		for(auto n = size - sizeof(Footer_t) + 1; n; --n, ++p)
+		// Lyrics3v2: walk the fields up to the size field
+		for(size_t offset = sizeof(h); offset < f_size;)
 		{
-			auto& f = *reinterpret_cast<const Footer_t*>(p);
-			if( f.isValid() )
-				return (reinterpret_cast<const uchar*>(&f + 1) - pData);
+			auto rest = f_size - offset;
+			if(rest >= sizeof(SizeField_t) + sizeof(Footer_t))
+			{
+				auto& s = *reinterpret_cast<const SizeField_t*>(pData + offset);
+				auto& f = *reinterpret_cast<const Footer_t*>(pData + offset + sizeof(s));
+				if(f.isV2() && s.get(tagSize) && tagSize == offset)
+					return offset + sizeof(s) + sizeof(f);
+			}
+
+			size_t fieldSize;
+			if(rest < sizeof(Field_t) || !reinterpret_cast<const Field_t*>(pData + offset)->get(fieldSize))
+				break;
+			offset += sizeof(Field_t) + fieldSize;
 		}
 
+		// Lyrics3v1: no size, the text is followed by the footer
+		auto footer = find(pData + sizeof(h), std::min(size, s_maxSizeV1 - sizeof(h)), s_idFooterV1, sizeof(s_idFooterV1) - 1);
+		if(footer + sizeof(Footer_t) <= size)
+			return sizeof(h) + footer + sizeof(Footer_t);
+
 		// Lyrics tag footer not found
+		f_status = Status{Status::ErrTruncated, f_size};
 		return 0;
 	}
 
+	size_t ILyrics::getTrailingSize(const unsigned char* f_data, size_t f_end, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+		if(f_end < sizeof(Header_t) + sizeof(Footer_t))
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+		auto& f = *reinterpret_cast<const Footer_t*>(f_data + f_end - sizeof(Footer_t));
+
+		size_t tagSize;
+		if(f.isV2())
+		{
+			// Anchored by the size field
+			Probe probe;
+			tagSize = ILyrics::probe(f_data, f_end, probe, f_status);
+			if(!tagSize)
+				return 0;
+			if(tagSize > f_end)
+			{
+				f_status = Status{Status::ErrTruncated, 0};
+				return tagSize;
+			}
+			if(!reinterpret_cast<const Header_t*>(f_data + f_end - tagSize)->isValid())
+			{
+				f_status = Status{Status::ErrInvalidHeader, f_end - tagSize};
+				return 0;
+			}
+		}
+		else if(f.isV1())
+		{
+			// No size field: the header closest to the footer within the size limit
+			auto maxSize = (f_end < s_maxSizeV1) ? f_end : s_maxSizeV1;
+			auto pBegin = f_data + f_end - maxSize;
+			auto regionSize = maxSize - sizeof(f);
+			auto header = regionSize;
+			for(size_t pos = 0; pos < regionSize;)
+			{
+				auto next = pos + find(pBegin + pos, regionSize - pos, s_idHeader, sizeof(s_idHeader) - 1);
+				if(next >= regionSize)
+					break;
+				header = next;
+				pos = next + 1;
+			}
+			if(header < regionSize)
+				return maxSize - header;
+			if(maxSize < s_maxSizeV1)
+			{
+				f_status = Status{Status::ErrTruncated, 0};
+				return s_maxSizeV1;
+			}
+			f_status = Status{Status::ErrInvalidHeader, f_end - maxSize};
+			return 0;
+		}
+		else
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+
+		return tagSize;
+	}
+
+	size_t ILyrics::probeSize()
+	{
+		return sizeof(SizeField_t) + sizeof(Footer_t);
+	}
+
+	size_t ILyrics::probe(const unsigned char* f_data, size_t f_end, Probe& f_probe, Status& f_status)
+	{
+		f_status = Status{Status::ErrNone, 0};
+		f_probe = Probe{0, 0, 0};
+
+		if(f_end < sizeof(Footer_t))
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+		auto& f = *reinterpret_cast<const Footer_t*>(f_data + f_end - sizeof(Footer_t));
+		if(f.isV1())
+		{
+			f_status = Status{Status::ErrUnsupported, f_end - sizeof(f)};
+			return 0;
+		}
+		if(!f.isV2())
+		{
+			f_status.error = Status::ErrNotFound;
+			return 0;
+		}
+
+		// The size field counts the header and the fields
+		if(f_end < sizeof(SizeField_t) + sizeof(f))
+		{
+			f_status = Status{Status::ErrInvalidFooter, 0};
+			return 0;
+		}
+		size_t size;
+		auto& s = *reinterpret_cast<const SizeField_t*>(reinterpret_cast<const uchar*>(&f) - sizeof(SizeField_t));
+		if(!s.get(size) || size < sizeof(Header_t))
+		{
+			f_status = Status{Status::ErrInvalidFooter, f_end - sizeof(s) - sizeof(f)};
+			return 0;
+		}
+
+		f_probe = Probe{2, 0, size + sizeof(s) + sizeof(f)};
+		return f_probe.size;
+	}
+
 	std::shared_ptr<ILyrics> ILyrics::create(const unsigned char* f_data, size_t f_offset, size_t f_size)
 	{
 		return std::make_shared<CLyrics>(f_data, f_offset, f_size);
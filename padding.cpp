@@ -0,0 +1,151 @@
+#include "tag.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+
+class CFixedPadding : public Tag::IPaddingPolicy
+{
+public:
+	explicit CFixedPadding(size_t f_padding): m_padding(f_padding) {}
+
+	size_t getTagSize(size_t f_size) const final override { return f_size + m_padding; }
+	void onEdit(size_t, size_t) final override {}
+
+private:
+	size_t m_padding;
+};
+
+
+class CProportionalPadding : public Tag::IPaddingPolicy
+{
+public:
+	CProportionalPadding(double f_ratio, size_t f_minimum): m_ratio(f_ratio), m_minimum(f_minimum) {}
+
+	size_t getTagSize(size_t f_size) const final override { return f_size + std::max(m_minimum, static_cast<size_t>(f_size * m_ratio)); }
+	void onEdit(size_t, size_t) final override {}
+
+private:
+	double m_ratio;
+	size_t m_minimum;
+};
+
+
+class CBlockPadding : public Tag::IPaddingPolicy
+{
+public:
+	CBlockPadding(size_t f_block, size_t f_minimum): m_block(f_block), m_minimum(f_minimum) {}
+
+	size_t getTagSize(size_t f_size) const final override { return (f_size + m_minimum + m_block - 1) / m_block * m_block; }
+	void onEdit(size_t, size_t) final override {}
+
+private:
+	size_t m_block;
+	size_t m_minimum;
+};
+
+
+// The growth of the last saves (shrinking counts as none) in a ring. The
+// padding is the quantile of the growth of any f_edits saves in a row.
+class CLearnedPadding : public Tag::IPaddingPolicy
+{
+public:
+	CLearnedPadding(uint f_edits, double f_quantile, size_t f_minimum);
+
+	size_t getTagSize(size_t f_size) const final override;
+	void onEdit(size_t f_before, size_t f_after) final override;
+
+private:
+	static const size_t History = 256;
+
+	uint				m_edits;
+	double				m_quantile;
+	size_t				m_minimum;
+
+	// Saves may run on several threads
+	mutable std::mutex	m_mutex;
+	std::vector<size_t>	m_growth;
+	size_t				m_next;
+};
+
+
+CLearnedPadding::CLearnedPadding(uint f_edits, double f_quantile, size_t f_minimum):
+	m_edits(f_edits),
+	m_quantile(f_quantile),
+	m_minimum(f_minimum),
+	m_next(0)
+{
+	m_growth.reserve(History);
+}
+
+
+size_t CLearnedPadding::getTagSize(size_t f_size) const
+{
+	// The growth of m_edits successive saves, for every save in the history
+	std::vector<size_t> growth;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto n = m_growth.size();
+		if(!n)
+			return f_size + m_minimum;
+		growth.resize(n);
+		size_t sum = 0;
+		for(size_t i = 0; i < n + m_edits; ++i)
+		{
+			sum += m_growth[i % n];
+			if(i >= m_edits)
+				sum -= m_growth[(i - m_edits) % n];
+			if(i + 1 >= m_edits && i + 1 - m_edits < n)
+				growth[i + 1 - m_edits] = sum;
+		}
+	}
+
+	auto pQuantile = growth.begin() + static_cast<size_t>(m_quantile * (growth.size() - 1));
+	std::nth_element(growth.begin(), pQuantile, growth.end());
+	return f_size + std::max(m_minimum, *pQuantile);
+}
+
+
+void CLearnedPadding::onEdit(size_t f_before, size_t f_after)
+{
+	auto growth = (f_after > f_before) ? f_after - f_before : 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if(m_growth.size() < History)
+		m_growth.push_back(growth);
+	else
+		m_growth[m_next] = growth;
+	m_next = (m_next + 1) % History;
+}
+
+// ====================================
+namespace Tag
+{
+	std::shared_ptr<IPaddingPolicy> IPaddingPolicy::createFixed(size_t f_padding)
+	{
+		return std::make_shared<CFixedPadding>(f_padding);
+	}
+
+	std::shared_ptr<IPaddingPolicy> IPaddingPolicy::createProportional(double f_ratio, size_t f_minimum)
+	{
+		ASSERT(f_ratio >= 0);
+		return std::make_shared<CProportionalPadding>(f_ratio, f_minimum);
+	}
+
+	std::shared_ptr<IPaddingPolicy> IPaddingPolicy::createBlock(size_t f_block, size_t f_minimum)
+	{
+		ASSERT(f_block);
+		return std::make_shared<CBlockPadding>(f_block, f_minimum);
+	}
+
+	std::shared_ptr<IPaddingPolicy> IPaddingPolicy::createLearned(unsigned f_edits, double f_quantile, size_t f_minimum)
+	{
+		ASSERT(f_quantile >= 0 && f_quantile <= 1);
+		return std::make_shared<CLearnedPadding>(f_edits, f_quantile, f_minimum);
+	}
+
+	IPaddingPolicy::~IPaddingPolicy() {}
+}
@@ -0,0 +1,41 @@
+#include "tag.h"
+
+#include "common.h"
+#include "id3v2.h"
+
+
+class CParser : public Tag::IParser
+{
+public:
+	using Tag::IParser::parseID3v2;
+	const Tag::IID3v2* parseID3v2(const uchar* f_data, size_t f_offset, size_t f_size, unsigned f_fields, Tag::Status& f_status) final override
+	{
+		f_status = m_id3v2.load(f_data, f_offset, f_size, true, f_fields);
+		return f_status.ok() ? &m_id3v2 : nullptr;
+	}
+
+	void setDiagnosticSink(Tag::IDiagnosticSink* f_sink) final override { m_id3v2.setDiagnosticSink(f_sink); }
+	void setLimits(const Tag::Limits& f_limits) final override { m_id3v2.setLimits(f_limits); }
+
+private:
+	CID3v2 m_id3v2;
+};
+
+// ====================================
+namespace Tag
+{
+	std::shared_ptr<IParser> IParser::create()
+	{
+		return std::make_shared<CParser>();
+	}
+
+	const IID3v2& IParser::parseID3v2(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields)
+	{
+		Status status;
+		auto tag = parseID3v2(f_data, f_offset, f_size, f_fields, status);
+		ASSERT_MSG(tag, status.str());
+		return *tag;
+	}
+
+	IParser::~IParser() {}
+}
@@ -0,0 +1,86 @@
+#include "tag.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+
+namespace Tag
+{
+	size_t Picture::read(int f_fd, size_t f_tagOffset, void* f_buffer, size_t f_size, size_t f_from) const
+	{
+		if(f_from >= size)
+			return 0;
+		auto pBuffer = static_cast<unsigned char*>(f_buffer);
+		auto left = std::min(f_size, size - f_from);
+		auto position = f_tagOffset + offset + f_from;
+
+		size_t done = 0;
+		while(done < left)
+		{
+			auto n = pread(f_fd, pBuffer + done, left - done, position + done);
+			if(n == -1 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			done += n;
+		}
+		return done;
+	}
+
+	bool Picture::copy(int f_fd, size_t f_tagOffset, int f_outFd) const
+	{
+		off_t position = f_tagOffset + offset;
+		size_t left = size;
+
+#if defined(__linux__)
+		// Both files: the data may not even be read (reflinks, server-side copies)
+		while(left)
+		{
+			loff_t in = position;
+			auto n = copy_file_range(f_fd, &in, f_outFd, nullptr, left, 0);
+			if(n == -1 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			position += n;
+			left -= n;
+		}
+
+		// Any output (a pipe, a socket)
+		while(left)
+		{
+			auto n = sendfile(f_outFd, f_fd, &position, left);
+			if(n == -1 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			left -= n;
+		}
+#endif
+
+		unsigned char buffer[64 * 1024];
+		while(left)
+		{
+			auto n = read(f_fd, f_tagOffset, buffer, std::min(left, sizeof(buffer)), size - left);
+			if(!n)
+				return false;
+			for(size_t done = 0; done < n;)
+			{
+				auto w = write(f_outFd, buffer + done, n - done);
+				if(w == -1 && errno == EINTR)
+					continue;
+				if(w <= 0)
+					return false;
+				done += w;
+			}
+			left -= n;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,137 @@
+#include "reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring> // memcpy
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+CFileReader::CFileReader(int f_fd, Tag::IFile::Access f_access):
+	m_fd(f_fd),
+	m_access(f_access),
+	m_size(0),
+	m_map(nullptr),
+	m_headSize(0),
+	m_tailSize(0),
+	m_status{Tag::Status::ErrNone, 0}
+{}
+
+
+CFileReader::~CFileReader()
+{
+	if(m_map)
+		munmap(const_cast<uchar*>(m_map), m_size);
+}
+
+
+Tag::Status CFileReader::open()
+{
+	struct stat st;
+	if(fstat(m_fd, &st) == -1)
+		return m_status = Tag::Status{Tag::Status::ErrIO, 0};
+	m_size = st.st_size;
+
+	if(m_access == Tag::IFile::AccessMap && m_size)
+	{
+		auto p = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+		if(p == MAP_FAILED)
+			return m_status = Tag::Status{Tag::Status::ErrIO, 0};
+		m_map = static_cast<const uchar*>(p);
+
+		// No read-ahead: only the windows are needed
+		madvise(p, m_size, MADV_RANDOM);
+	}
+
+	return m_status;
+}
+
+
+const uchar* CFileReader::head(size_t f_size)
+{
+	ASSERT(f_size <= m_size);
+	if(f_size > m_headSize)
+	{
+		// Read up to the tail window, which has the rest
+		auto end = std::max(m_headSize, std::min(f_size, tailOffset()));
+		if(m_map)
+			willNeed(m_headSize, end - m_headSize);
+		else
+		{
+			m_head.resize(f_size);
+			if(!read(m_head.data() + m_headSize, m_headSize, end - m_headSize))
+			{
+				m_head.resize(m_headSize);
+				return m_head.data();
+			}
+			if(end < f_size)
+				memcpy(m_head.data() + end, tailData() + (end - tailOffset()), f_size - end);
+		}
+		m_headSize = f_size;
+	}
+	return m_map ? m_map : m_head.data();
+}
+
+
+const uchar* CFileReader::tail(size_t f_offset)
+{
+	ASSERT(f_offset <= m_size);
+	auto offset = tailOffset();
+	if(f_offset < offset)
+	{
+		// Read from the end of the head window, which has the rest
+		auto begin = std::min(offset, std::max(f_offset, m_headSize));
+		if(m_map)
+			willNeed(begin, offset - begin);
+		else
+		{
+			// The window is at the end of m_tail, which grows toward the front
+			auto size = m_size - f_offset;
+			if(size > m_tail.size())
+			{
+				std::vector<uchar> tail(std::max(size, 2 * m_tail.size()));
+				if(m_tailSize)
+					memcpy(tail.data() + (tail.size() - m_tailSize), tailData(), m_tailSize);
+				m_tail.swap(tail);
+			}
+			auto pWindow = m_tail.data() + (m_tail.size() - size);
+			if(!read(pWindow + (begin - f_offset), begin, offset - begin))
+				return tailData();
+			if(f_offset < begin)
+				memcpy(pWindow, m_head.data() + f_offset, begin - f_offset);
+		}
+		m_tailSize = m_size - f_offset;
+		offset = f_offset;
+	}
+	return (m_map ? m_map + offset : tailData()) + (f_offset - offset);
+}
+
+
+bool CFileReader::read(uchar* f_buffer, size_t f_offset, size_t f_size)
+{
+	while(f_size)
+	{
+		auto n = pread(m_fd, f_buffer, f_size, f_offset);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+		{
+			// A file shrunk under us is an I/O error as well
+			m_status = Tag::Status{Tag::Status::ErrIO, f_offset};
+			return false;
+		}
+		f_buffer += n;
+		f_offset += n;
+		f_size -= n;
+	}
+	return true;
+}
+
+
+void CFileReader::willNeed(size_t f_offset, size_t f_size)
+{
+	static const size_t pageSize = sysconf(_SC_PAGESIZE);
+	auto begin = f_offset & ~(pageSize - 1);
+	madvise(const_cast<uchar*>(m_map) + begin, f_offset + f_size - begin, MADV_WILLNEED);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "tag.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// Reads the head and the tail of a file on demand: the head window grows
+// forwards and the tail one backwards, so every byte is read once at most
+class CFileReader
+{
+public:
+	// The descriptor is not owned
+	CFileReader(int f_fd, Tag::IFile::Access f_access);
+	~CFileReader();
+	CFileReader(const CFileReader&) = delete;
+	CFileReader& operator=(const CFileReader&) = delete;
+
+	Tag::Status open();
+
+	size_t size() const { return m_size; }
+
+	// Check status() for I/O errors. The pointers stay valid until the next
+	// call for the same window.
+	// The first f_size bytes of the file
+	const uchar* head(size_t f_size);
+	// The file from f_offset to the end
+	const uchar* tail(size_t f_offset);
+
+	size_t tailOffset() const { return m_size - m_tailSize; }
+	// The windows may overlap on small files
+	size_t bytesRead() const { return std::min(m_size, m_headSize + m_tailSize); }
+
+	const Tag::Status& status() const { return m_status; }
+
+private:
+	bool read(uchar* f_buffer, size_t f_offset, size_t f_size);
+	// AccessRead: the tail window, at the end of m_tail
+	const uchar* tailData() const { return m_tail.data() + (m_tail.size() - m_tailSize); }
+	void willNeed(size_t f_offset, size_t f_size);
+
+private:
+	int					m_fd;
+	Tag::IFile::Access	m_access;
+	size_t				m_size;
+
+	// AccessMap
+	const uchar*		m_map;
+
+	// AccessRead: the windows ([0, m_headSize) and [m_size - m_tailSize, m_size)),
+	// the tail one at the end of m_tail
+	std::vector<uchar>	m_head;
+	std::vector<uchar>	m_tail;
+	size_t				m_headSize;
+	size_t				m_tailSize;
+
+	Tag::Status			m_status;
+};
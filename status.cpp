@@ -0,0 +1,54 @@
+#include "tag.h"
+
+#include "common.h"
+
+
+namespace Tag
+{
+	std::string Status::str() const
+	{
+		static const char* const s_errors[] =
+		{
+			"OK",
+			"Tag not found",
+			"Truncated tag",
+			"Unsupported version or feature",
+			"Invalid header",
+			"Invalid frame",
+			"Invalid padding",
+			"Invalid item",
+			"Invalid footer",
+			"I/O error",
+			"Limit exceeded"
+		};
+		static_assert(sizeof(s_errors) / sizeof(*s_errors) == ErrLimit + 1, "Status descriptions mismatch");
+
+		return std::string(s_errors[error]) + " @ " + std::to_string(offset);
+	}
+
+
+	std::string Diagnostic::str() const
+	{
+		static const char* const s_codes[] =
+		{
+			"read-only frame",
+			"short comment",
+			"truncated frame",
+			"malformed frame"
+		};
+		static_assert(sizeof(s_codes) / sizeof(*s_codes) == DiagMalformedFrame + 1, "Diagnostic descriptions mismatch");
+
+		std::string str(s_codes[code]);
+		if(frameId)
+		{
+			str += " \"";
+			for(uint i = 0; i < 4; ++i)
+				str += static_cast<char>(frameId >> (i * 8));
+			str += "\"";
+		}
+		return str + " @ " + std::to_string(offset);
+	}
+
+
+	IDiagnosticSink::~IDiagnosticSink() {}
+}
@@ -0,0 +1,356 @@
+#include "tag.h"
+
+#include "common.h"
+#include "diagnostics.h"
+#include "frame.h"
+#include "id3v2.h"
+
+#include <algorithm>
+#include <cstddef> // offsetof
+#include <vector>
+
+
+// The frame walk of CID3v2::scan3 as a state machine: the input is
+// consumed as it comes and only the frame being assembled is kept
+class CStreamParser : public Tag::IStreamParser
+{
+public:
+	CStreamParser(Tag::IStreamHandler& f_handler, size_t f_bufferLimit, uint f_fields);
+
+	size_t push(const uchar* f_data, size_t f_size, Tag::Status& f_status) final override;
+	bool isComplete() const final override { return m_state == StateDone; }
+	void reset() final override;
+	void setLimits(const Tag::Limits& f_limits) final override { m_limits = f_limits; }
+
+	void setDiagnosticSink(Tag::IDiagnosticSink* f_sink) final override { m_diagnostics.setSink(f_sink); }
+	unsigned getDiagnosticCount() const final override { return m_diagnostics.count(); }
+	const Tag::Diagnostic& getDiagnostic(unsigned f_index) const final override { return m_diagnostics.get(f_index); }
+
+private:
+	enum State
+	{
+		StateTagHeader,
+		StateFrameHeader,
+		StateFrame,		// Buffered
+		StateChunks,	// Passed through
+		StateSkip,		// Not selected or declined
+		StatePadding,
+		StateDone,
+		StateError
+	};
+
+	using Status = Tag::Status;
+
+	// Appends to m_buffer up to f_target bytes
+	void fill(const uchar*& f_ioData, size_t& f_ioSize, size_t f_target);
+	void consume(const uchar*& f_ioData, size_t& f_ioSize, size_t f_count);
+
+	Status startTag();
+	Status startFrame();
+	Status endFrame();
+
+private:
+	Tag::IStreamHandler&	m_handler;
+	size_t					m_bufferLimit;
+	uint					m_fields;
+	Tag::Limits				m_limits;
+
+	State					m_state;
+	Status					m_status;
+	// From the beginning of the tag, without the buffered bytes
+	size_t					m_offset;
+	size_t					m_end;
+	uint					m_version;
+
+	// The current frame (or the padding)
+	uint					m_frameCount;
+	uint					m_frameId;
+	FrameType				m_frameType;
+	size_t					m_frameOffset;
+	// Payload bytes to be passed through or skipped
+	size_t					m_left;
+	// The tag header, then the current frame with its header
+	std::vector<uchar>		m_buffer;
+
+	CDiagnostics			m_diagnostics;
+};
+
+
+CStreamParser::CStreamParser(Tag::IStreamHandler& f_handler, size_t f_bufferLimit, uint f_fields):
+	m_handler(f_handler),
+	m_bufferLimit(f_bufferLimit),
+	m_fields(f_fields),
+	m_limits(Tag::Limits::none())
+{
+	ASSERT(f_bufferLimit >= sizeof(Frame3::Header_t));
+	m_buffer.reserve(f_bufferLimit);
+	reset();
+}
+
+
+void CStreamParser::reset()
+{
+	m_state = StateTagHeader;
+	m_status = Status{Status::ErrNone, 0};
+	m_offset = 0;
+	m_end = 0;
+	m_version = 0;
+	m_frameCount = 0;
+	m_frameId = 0;
+	m_frameType = FrameUnknown;
+	m_frameOffset = 0;
+	m_left = 0;
+	m_buffer.clear();
+	m_diagnostics.reset(nullptr);
+}
+
+
+size_t CStreamParser::push(const uchar* f_data, size_t f_size, Status& f_status)
+{
+	auto pData = f_data;
+	auto size = f_size;
+
+	while(m_status.ok())
+	{
+		if(m_state == StateTagHeader)
+		{
+			fill(pData, size, sizeof(CID3v2::Tag_t::Header_t));
+			if(m_buffer.size() < sizeof(CID3v2::Tag_t::Header_t))
+				break;
+			m_status = startTag();
+		}
+		else if(m_state == StateFrameHeader)
+		{
+			// The same bounds as scan3
+			if(m_end - m_offset < sizeof(Frame3::Header_t))
+			{
+				m_frameOffset = m_offset;
+				m_state = StatePadding;
+				continue;
+			}
+			fill(pData, size, sizeof(Frame3::Header_t));
+			if(m_buffer.size() < sizeof(Frame3::Header_t))
+				break;
+			m_status = startFrame();
+		}
+		else if(m_state == StateFrame)
+		{
+			fill(pData, size, sizeof(Frame3::Header_t) + m_left);
+			if(m_buffer.size() < sizeof(Frame3::Header_t) + m_left)
+				break;
+			m_status = endFrame();
+		}
+		else if(m_state == StateChunks || m_state == StateSkip)
+		{
+			auto n = std::min(size, m_left);
+			if(n && m_state == StateChunks)
+				m_handler.onChunk(m_frameId, Tag::Span{pData, n});
+			consume(pData, size, n);
+			m_left -= n;
+			if(m_left)
+				break;
+			m_state = StateFrameHeader;
+		}
+		else if(m_state == StatePadding)
+		{
+			// Frame header bytes that turned out to be padding come first.
+			// Errors point to the beginning of the padding (as in scan3).
+			auto pNonZero = std::find_if(m_buffer.begin(), m_buffer.end(), [](uchar c){ return c != 0; });
+			if(pNonZero != m_buffer.end())
+			{
+				m_status = Status{Status::ErrInvalidPadding, m_frameOffset};
+				break;
+			}
+			m_offset += m_buffer.size();
+			m_buffer.clear();
+
+			auto n = std::min(size, m_end - m_offset);
+			auto pEnd = std::find_if(pData, pData + n, [](uchar c){ return c != 0; });
+			if(pEnd != pData + n)
+			{
+				m_status = Status{Status::ErrInvalidPadding, m_frameOffset};
+				break;
+			}
+			consume(pData, size, n);
+			if(m_offset < m_end)
+				break;
+			m_state = StateDone;
+		}
+		else
+			break;
+	}
+
+	if(!m_status.ok())
+		m_state = StateError;
+	f_status = m_status;
+	return pData - f_data;
+}
+
+
+void CStreamParser::fill(const uchar*& f_ioData, size_t& f_ioSize, size_t f_target)
+{
+	auto n = std::min(f_ioSize, f_target - m_buffer.size());
+	m_buffer.insert(m_buffer.end(), f_ioData, f_ioData + n);
+	f_ioData += n;
+	f_ioSize -= n;
+}
+
+
+void CStreamParser::consume(const uchar*& f_ioData, size_t& f_ioSize, size_t f_count)
+{
+	f_ioData += f_count;
+	f_ioSize -= f_count;
+	m_offset += f_count;
+}
+
+
+Tag::Status CStreamParser::startTag()
+{
+	auto& header = reinterpret_cast<const CID3v2::Tag_t*>(m_buffer.data())->Header;
+	if(!header.isValid())
+		return Status{Status::ErrNotFound, 0};
+	if(sizeof(header) + header.size() > m_limits.tagSize)
+		return Status{Status::ErrLimit, offsetof(CID3v2::Tag_t::Header_t, SizeRaw)};
+	auto status = CID3v2::checkSupport(header);
+	if(!status.ok())
+		return status;
+
+	m_offset = sizeof(header);
+	m_end = sizeof(header) + header.size();
+	m_version = header.Version;
+	m_buffer.clear();
+	m_state = StateFrameHeader;
+	return status;
+}
+
+
+Tag::Status CStreamParser::startFrame()
+{
+	auto& f = *reinterpret_cast<const Frame3*>(m_buffer.data());
+	m_frameOffset = m_offset;
+	m_diagnostics.rebase(m_buffer.data(), m_frameOffset);
+
+	if(!f.Header.isValid())
+	{
+		m_state = StatePadding;
+		return Status{Status::ErrNone, 0};
+	}
+
+	switch(CFrame3::checkFlags(f.Header))
+	{
+		case CFrame3::FlagsOK:
+			break;
+		case CFrame3::FlagsReadOnly:
+			m_diagnostics.report(Tag::Diagnostic::DiagReadOnlyFrame, f.Header.IdFourCC, m_buffer.data());
+			break;
+		case CFrame3::FlagsUnsupported:
+			return Status{Status::ErrUnsupported, m_frameOffset + offsetof(Frame3::Header_t, Flags)};
+		case CFrame3::FlagsInvalid:
+			return Status{Status::ErrInvalidFrame, m_frameOffset + offsetof(Frame3::Header_t, Flags)};
+	}
+
+	// The same checks as scan3 and parse3
+	if(!f.Header.isValidSize(m_version))
+		return Status{Status::ErrInvalidFrame, m_frameOffset + offsetof(Frame3::Header_t, SizeRaw)};
+	auto frameSize = f.Header.size(m_version);
+	if(frameSize > m_limits.frameSize)
+		return Status{Status::ErrLimit, m_frameOffset + offsetof(Frame3::Header_t, SizeRaw)};
+	if(m_frameCount++ == m_limits.frameCount)
+		return Status{Status::ErrLimit, m_frameOffset};
+	if(sizeof(f.Header) + frameSize > m_end - m_frameOffset)
+	{
+		m_diagnostics.report(Tag::Diagnostic::DiagTruncatedFrame, f.Header.IdFourCC, m_buffer.data());
+		frameSize = m_end - m_frameOffset - sizeof(f.Header);
+	}
+
+	m_frameId = f.Header.IdFourCC;
+	m_frameType = CFrame3::getFrameType(f.Header);
+	m_left = frameSize;
+
+	if(!(m_fields & (1u << m_frameType)))
+		m_state = StateSkip;
+	else if(CFrame3::isText(m_frameType) && frameSize > m_limits.textSize)
+		return Status{Status::ErrLimit, m_frameOffset + offsetof(Frame3::Header_t, SizeRaw)};
+	else if(sizeof(f.Header) + frameSize <= m_bufferLimit)
+		m_state = StateFrame;
+	else
+		m_state = m_handler.onLargeFrame(m_frameId, frameSize) ? StateChunks : StateSkip;
+
+	// Only buffered frames keep their header
+	if(m_state != StateFrame)
+	{
+		m_offset += sizeof(f.Header);
+		m_buffer.clear();
+	}
+	return Status{Status::ErrNone, 0};
+}
+
+
+template<typename T_Frame>
+static bool decode(const Frame3& f_frame, size_t f_size, CDiagnostics& f_diagnostics, std::string& f_text)
+{
+	T_Frame frame(f_frame, f_size);
+	if(!frame.decode(f_diagnostics))
+		return false;
+	f_text = frame.getText();
+	return true;
+}
+
+
+Tag::Status CStreamParser::endFrame()
+{
+	auto& f = *reinterpret_cast<const Frame3*>(m_buffer.data());
+	auto size = m_buffer.size() - sizeof(f.Header);
+	m_diagnostics.rebase(m_buffer.data(), m_frameOffset);
+
+	// The payload is decoded right away, so a malformed one fails the tag
+	// (IID3v2 getters return empty values for it instead)
+	bool ok = true;
+	std::string text;
+	switch(m_frameType)
+	{
+		case FramePicture:
+		case FrameUnknown:
+			m_handler.onFrame(m_frameId, Tag::Span{f.Data, size});
+			break;
+		case FrameComment:
+			// MusicMatch frames are not comments
+			if(CCommentFrame3::isMMJB(f, size))
+				m_handler.onFrame(m_frameId, Tag::Span{f.Data, size});
+			else if((ok = decode<CCommentFrame3>(f, size, m_diagnostics, text)))
+				m_handler.onText(m_frameId, text);
+			break;
+		case FrameGenre:
+			if((ok = decode<CGenreFrame3>(f, size, m_diagnostics, text)))
+				m_handler.onText(m_frameId, text);
+			break;
+		case FrameURL:
+			if((ok = decode<CURLFrame3>(f, size, m_diagnostics, text)))
+				m_handler.onText(m_frameId, text);
+			break;
+		default:
+			if((ok = decode<CTextFrame3>(f, size, m_diagnostics, text)))
+				m_handler.onText(m_frameId, text);
+			break;
+	}
+	if(!ok)
+		return Status{Status::ErrInvalidFrame, m_frameOffset + sizeof(f.Header)};
+
+	m_offset += m_buffer.size();
+	m_buffer.clear();
+	m_state = StateFrameHeader;
+	return Status{Status::ErrNone, 0};
+}
+
+// ====================================
+namespace Tag
+{
+	std::shared_ptr<IStreamParser> IStreamParser::create(IStreamHandler& f_handler, size_t f_bufferLimit, unsigned f_fields)
+	{
+		return std::make_shared<CStreamParser>(f_handler, f_bufferLimit, f_fields);
+	}
+
+	IStreamParser::~IStreamParser() {}
+
+	IStreamHandler::~IStreamHandler() {}
+}
@@ -4,25 +4,216 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <functional>
 
 
 namespace Tag
 {
+	// A non-owning view of bytes kept by a tag (or by the buffer the tag borrows)
+	struct Span
+	{
+		const unsigned char*	data;
+		size_t					size;
+	};
+
+
+	// The result of the non-throwing parse functions (they take Status& and
+	// never throw on bad input data). The throwing ones return 0 or throw
+	// std::logic_error for the same errors.
+	struct Status
+	{
+		enum Error
+		{
+			ErrNone,
+			ErrNotFound,		// No tag at the offset
+			ErrTruncated,		// The tag does not fit into the buffer
+			ErrUnsupported,		// A version or feature that is not supported
+			ErrInvalidHeader,
+			ErrInvalidFrame,	// ID3v2 frame header
+			ErrInvalidPadding,	// ID3v2 padding
+			ErrInvalidItem,		// APE item
+			ErrInvalidFooter,
+			ErrIO,				// A file cannot be opened or read (see errno)
+			ErrLimit			// The tag declares more than Limits allow
+		};
+
+		Error	error;
+		// Where the problem was found (relative to the beginning of the tag)
+		size_t	offset;
+
+		bool		ok		() const { return error == ErrNone; }
+		// No tag or an incomplete one rather than a broken one
+		bool		isAbsent() const { return error == ErrNotFound || error == ErrTruncated; }
+		std::string	str		() const;
+	};
+
+
+	// Resource limits of a parse: what a tag declares is checked against them
+	// before anything is allocated or read for it (ErrLimit). Limits are per
+	// context (IParser, IStreamParser, IFile, IBatch) and none by default.
+	struct Limits
+	{
+		size_t		tagSize;	// A whole tag: ID3v2, or the trailing ones together (IFile)
+		size_t		frameSize;	// An ID3v2 frame payload
+		unsigned	frameCount;	// ID3v2 frames
+		size_t		textSize;	// A text frame payload (decoded text is up to twice as long)
+
+		static Limits none() { return Limits{~size_t(0), ~size_t(0), ~0u, ~size_t(0)}; }
+	};
+
+
+	// An image in an ID3v2 tag: the bytes stay where they are (in the file or
+	// the buffer the tag was parsed from) until they are fetched
+	struct Picture
+	{
+		size_t		offset;		// Of the image data, from the beginning of the tag
+		size_t		size;
+		std::string	mime;
+		unsigned	type;		// APIC picture type (3 is the front cover)
+		std::string	description;
+
+		// From a file with the tag at f_tagOffset: up to f_size bytes of the image
+		// starting at f_from. Returns the number of bytes read (short on I/O errors).
+		size_t	read	(int f_fd, size_t f_tagOffset, void* f_buffer, size_t f_size, size_t f_from = 0) const;
+		// The whole image to f_outFd at its position, file to file in the kernel
+		// where possible (copy_file_range, then sendfile)
+		bool	copy	(int f_fd, size_t f_tagOffset, int f_outFd) const;
+	};
+
+
+	// What the fixed-size part of a tag declares (see the probe functions): a
+	// file needs two reads per tag, the probe and then exactly the whole tag
+	struct Probe
+	{
+		unsigned	version;	// ID3v2 minor version, APE version (1000 or 2000) or 2 for Lyrics3v2
+		unsigned	flags;		// ID3v2 header flags or APE tag flags (0 for Lyrics3v2)
+		size_t		size;		// The whole tag (with the header and the footer)
+	};
+
+
+	// A non-fatal finding: the tag is usable but has something unusual
+	struct Diagnostic
+	{
+		enum Code
+		{
+			DiagReadOnlyFrame,		// The flag is cleared if the frame is modified
+			DiagShortComment,		// A comment has a short description
+			DiagTruncatedFrame,		// A frame runs past the tag and is truncated
+			DiagMalformedFrame		// The payload cannot be decoded: getters return empty values
+		};
+
+		Code		code;
+		// ID3v2 frame ID as FourCC (0 if not related to a frame)
+		unsigned	frameId;
+		// Relative to the beginning of the tag
+		size_t		offset;
+
+		// The tag has been repaired (see IID3v2::hasIssues)
+		bool		isIssue	() const { return code == DiagTruncatedFrame; }
+		std::string	str		() const;
+	};
+
+	// Receives diagnostics as they are found (on the parsing thread or, for
+	// lazily decoded frames, on the thread calling the getter)
+	class IDiagnosticSink
+	{
+	public:
+		virtual void report(const Diagnostic& f_diagnostic) = 0;
+
+		virtual ~IDiagnosticSink();
+	};
+
+
+	// A serialized tag as pieces written with one pwritev/writev: ranges of
+	// the data the tag holds or borrows (unchanged frames, pictures) are not
+	// copied, only encoded bytes are. The pieces are valid as long as the tag
+	// is alive and not modified. A range written over the bytes it points to
+	// (a borrowed mapping of the file) is only safe at its own offset.
+	class GatherList
+	{
+	public:
+		// Not copied
+		void	addSpan		(const unsigned char* f_data, size_t f_size);
+		void	addZeros	(size_t f_size);
+		// Bytes appended to getBuffer() since the last commit() become a piece
+		std::vector<unsigned char>&	getBuffer	() { return m_buffer; }
+		void	commit		();
+
+		size_t	getSize		() const { return m_size; }
+		void	clear		();
+
+		// All the bytes in order (appended)
+		void	flatten		(std::vector<unsigned char>& f_outStream) const;
+		// pwritev at f_offset (retried on short writes)
+		bool	write		(int f_fd, size_t f_offset) const;
+		// writev at the position of f_fd (pipes, sockets)
+		bool	write		(int f_fd) const;
+
+	private:
+		struct Piece
+		{
+			const unsigned char*	data;	// nullptr: m_buffer from offset
+			size_t					offset;
+			size_t					size;
+		};
+
+		// -1: at the position of f_fd
+		bool	writeAt		(int f_fd, long f_offset) const;
+
+	private:
+		std::vector<Piece>			m_pieces;
+		std::vector<unsigned char>	m_buffer;
+		size_t						m_committed = 0;
+		size_t						m_size = 0;
+	};
+
+
 	class ISerialize
 	{
 	public:
 		virtual void serialize(std::vector<unsigned char>& f_outStream) = 0;
+		virtual void serialize(GatherList& f_outList) = 0;
 
 		virtual ~ISerialize();
 	};
 
 
+	// How much padding a written ID3v2 tag gets when it has to grow: edits
+	// that fit into the padding later are written in place
+	class IPaddingPolicy
+	{
+	public:
+		// f_padding bytes
+		static std::shared_ptr<IPaddingPolicy>	createFixed			(size_t f_padding = 4096);
+		// f_ratio of the tag, at least f_minimum bytes
+		static std::shared_ptr<IPaddingPolicy>	createProportional	(double f_ratio = 0.1, size_t f_minimum = 1024);
+		// At least f_minimum bytes, up to a multiple of f_block (the audio
+		// starts on a block boundary)
+		static std::shared_ptr<IPaddingPolicy>	createBlock			(size_t f_block = 4096, size_t f_minimum = 1024);
+		// Room for f_edits more edits, each growing the tag by the f_quantile
+		// of the growth seen in the last saves (at least f_minimum bytes).
+		// One policy is meant to be shared by the saves of a library.
+		static std::shared_ptr<IPaddingPolicy>	createLearned		(unsigned f_edits = 4, double f_quantile = 0.9, size_t f_minimum = 1024);
+
+	public:
+		// The size of a tag with f_size bytes of header and frames (at least f_size)
+		virtual size_t	getTagSize	(size_t f_size) const			= 0;
+		// A save changed the header and frames from f_before to f_after bytes
+		virtual void	onEdit		(size_t f_before, size_t f_after)	= 0;
+
+		virtual ~IPaddingPolicy();
+	};
+
+
 	class IID3v1 : public ISerialize
 	{
 	public:
 		static size_t					size	();
 		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size);
 		static std::shared_ptr<IID3v1>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size);
+		static std::shared_ptr<IID3v1>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status);
+		// See IAPE::getTrailingSize
+		static size_t					getTrailingSize(const unsigned char* f_data, size_t f_end, Status& f_status);
 		static std::shared_ptr<IID3v1>	create	();
 
 	public:
@@ -53,17 +244,67 @@ namespace Tag
 	};
 
 
+	// Frame payloads are decoded on the first access. Const getters may be
+	// called from several threads at once, but not while the tag is modified
 	class IID3v2 : public ISerialize
 	{
+	public:
+		// Frame selection: frames of other types are validated but not stored
+		// (their getters report no frames)
+		enum Field : unsigned
+		{
+			FieldTrack			= 1u <<  0,
+			FieldDisc			= 1u <<  1,
+			FieldBPM			= 1u <<  2,
+			FieldTitle			= 1u <<  3,
+			FieldArtist			= 1u <<  4,
+			FieldAlbum			= 1u <<  5,
+			FieldAlbumArtist	= 1u <<  6,
+			FieldYear			= 1u <<  7,
+			FieldGenre			= 1u <<  8,
+			FieldComment		= 1u <<  9,
+			FieldComposer		= 1u << 10,
+			FieldPublisher		= 1u << 11,
+			FieldOrigArtist		= 1u << 12,
+			FieldCopyright		= 1u << 13,
+			FieldURL			= 1u << 14,
+			FieldEncoded		= 1u << 15,
+			FieldPicture		= 1u << 16,
+			FieldUnknown		= 1u << 18,
+
+			FieldAll			= ~0u
+		};
+
 	public:
 		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size);
-		static std::shared_ptr<IID3v2>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size);
+		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status);
+		// The header only (probeSize() bytes): returns the declared size of the
+		// tag. A footer (ID3v2.4) is not verified until the tag is parsed.
+		static size_t					probeSize();
+		static size_t					probe	(const unsigned char* f_data, size_t f_offset, size_t f_size, Probe& f_probe, Status& f_status);
+		// Frame payloads are decoded lazily, so malformed payloads are reported
+		// by getters (as DiagMalformedFrame), which never throw for them
+		static std::shared_ptr<IID3v2>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields = FieldAll);
+		static std::shared_ptr<IID3v2>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status, unsigned f_fields = FieldAll);
 		static std::shared_ptr<IID3v2>	create	();
+		// Same as create() but the tag and its frames refer to f_data instead of
+		// copying it: the buffer must stay valid and unchanged while the tag lives
+		static std::shared_ptr<IID3v2>	createBorrowed(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields = FieldAll);
+		static std::shared_ptr<IID3v2>	createBorrowed(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status, unsigned f_fields = FieldAll);
 
 	public:
 		virtual bool				hasIssues			() const										= 0;
+		// Diagnostics of parsing and decoding (in the order they are found)
+		virtual unsigned			getDiagnosticCount	() const										= 0;
+		virtual const Diagnostic&	getDiagnostic		(unsigned f_index) const						= 0;
 
 		virtual size_t				getSize				() const										= 0;
+		// The zero bytes after the last frame: room for edits in place
+		virtual size_t				getPaddingSize		() const										= 0;
+
+		using ISerialize::serialize;
+		// Padded as f_policy chooses (serialize() keeps the size of the tag)
+		virtual void				serialize			(std::vector<unsigned char>& f_outStream, const IPaddingPolicy& f_policy)	= 0;
 
 		virtual unsigned			getMinorVersion		() const										= 0;
 		virtual unsigned			getRevision			() const										= 0;
@@ -141,18 +382,101 @@ namespace Tag
 
 		// Complex metadata
 		virtual unsigned							getPictureCount			() const					= 0;
-		virtual const std::vector<unsigned char>&	getPictureData			(unsigned f_index) const	= 0;
+		virtual Span								getPictureData			(unsigned f_index) const	= 0;
 		virtual const std::string&					getPictureDescription	(unsigned f_index) const	= 0;
+		// The image is not touched (see Picture)
+		virtual Picture								getPicture				(unsigned f_index) const	= 0;
 
 		virtual	std::vector<std::string>			getUnknownFrames		() const					= 0;
 	};
 
 
+	// A parsing context to be created once per thread and reused for many tags:
+	// the frame storage is recycled, so a typical tag is parsed without heap
+	// allocations. Use IID3v2::create() for results that must outlive the next call.
+	class IParser
+	{
+	public:
+		static std::shared_ptr<IParser>	create	();
+
+		// The result refers to f_data (which must stay valid and unchanged) and
+		// is valid until the next call or until the parser is destroyed
+		// Returns nullptr for bad input data
+		virtual const IID3v2*			parseID3v2	(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields, Status& f_status)	= 0;
+
+		const IID3v2&					parseID3v2	(const unsigned char* f_data, size_t f_offset, size_t f_size, unsigned f_fields = IID3v2::FieldAll);
+
+		// Diagnostics are always collected per tag; the sink (none by default)
+		// additionally receives them as they are found. The sink must outlive
+		// the parser and the tags it returns.
+		virtual void					setDiagnosticSink(IDiagnosticSink* f_sink)	= 0;
+		// For the following calls
+		virtual void					setLimits	(const Limits& f_limits)	= 0;
+
+		virtual ~IParser();
+	};
+
+
+	// Receives the frames of a tag pushed into IStreamParser (the spans and
+	// the strings are valid during the call only)
+	class IStreamHandler
+	{
+	public:
+		// A text frame: every IID3v2::Field but pictures and unknown frames
+		virtual void	onText		(unsigned f_frameId, const std::string& f_text)	= 0;
+		// Any other frame within the buffer limit (the payload without the header)
+		virtual void	onFrame		(unsigned f_frameId, const Span& f_payload)		= 0;
+		// A frame over the limit: true to receive its payload by chunks, false to skip it
+		virtual bool	onLargeFrame(unsigned f_frameId, size_t f_size)				= 0;
+		virtual void	onChunk		(unsigned f_frameId, const Span& f_chunk)		= 0;
+
+		virtual ~IStreamHandler();
+	};
+
+
+	// Parses an ID3v2 tag pushed in chunks of any size (a pipe, a socket).
+	// Frames are handed out as soon as they are complete and only the ones up
+	// to f_bufferLimit bytes (with the frame header) are buffered, so memory
+	// does not depend on the size of the tag.
+	class IStreamParser
+	{
+	public:
+		static std::shared_ptr<IStreamParser>	create	(IStreamHandler& f_handler, size_t f_bufferLimit = 64 * 1024, unsigned f_fields = IID3v2::FieldAll);
+
+		// Returns the number of bytes consumed: less than f_size once the tag
+		// ends (the rest follows the tag). Errors are final and status offsets
+		// are relative to the beginning of the tag.
+		virtual size_t				push				(const unsigned char* f_data, size_t f_size, Status& f_status)	= 0;
+		// The whole tag has been pushed
+		virtual bool				isComplete			() const						= 0;
+		// Starts a new tag (the buffer is kept)
+		virtual void				reset				()								= 0;
+		// The same checks as IParser (frames passed by chunks included)
+		virtual void				setLimits			(const Limits& f_limits)		= 0;
+
+		virtual void				setDiagnosticSink	(IDiagnosticSink* f_sink)		= 0;
+		virtual unsigned			getDiagnosticCount	() const						= 0;
+		virtual const Diagnostic&	getDiagnostic		(unsigned f_index) const		= 0;
+
+		virtual ~IStreamParser();
+	};
+
+
 	class IAPE : public ISerialize
 	{
 	public:
-		// Returns "negative" size when called for a valid footer
+		// A tag with a header at f_offset
 		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size);
+		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status);
+		// The size of a tag that ends at f_data + f_end (the data before it is
+		// searched backwards). ErrTruncated means the tag starts before f_data:
+		// the required size is returned then, so the caller can extend the buffer.
+		// Status offsets are relative to f_data.
+		static size_t					getTrailingSize(const unsigned char* f_data, size_t f_end, Status& f_status);
+		// The footer only (the probeSize() bytes before f_data + f_end): returns
+		// the declared size of the tag (with the header if there is one)
+		static size_t					probeSize();
+		static size_t					probe	(const unsigned char* f_data, size_t f_end, Probe& f_probe, Status& f_status);
 		static std::shared_ptr<IAPE>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size);
 
 		virtual size_t					getSize	() const	= 0;
@@ -163,12 +487,197 @@ namespace Tag
 	{
 	public:
 		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size);
+		static size_t					getSize	(const unsigned char* f_data, size_t f_offset, size_t f_size, Status& f_status);
+		// See IAPE::getTrailingSize
+		static size_t					getTrailingSize(const unsigned char* f_data, size_t f_end, Status& f_status);
+		// The size field and the footer only (the probeSize() bytes before
+		// f_data + f_end): see IAPE::probe. Lyrics3v1 has no size field, so
+		// ErrUnsupported is returned for it (use getTrailingSize).
+		static size_t					probeSize();
+		static size_t					probe	(const unsigned char* f_data, size_t f_end, Probe& f_probe, Status& f_status);
 		static std::shared_ptr<ILyrics>	create	(const unsigned char* f_data, size_t f_offset, size_t f_size);
 
 		virtual size_t					getSize	() const	= 0;
 	};
 
 
+	// Trailing tags found by locateTail (offsets are relative to f_data)
+	struct TailLayout
+	{
+		enum Kind
+		{
+			KindID3v1,
+			KindAPE,
+			KindLyrics,
+			KindCount
+		};
+
+		struct Region
+		{
+			size_t	offset;
+			size_t	size;		// 0 if there is no tag
+		};
+
+		Region	tags[KindCount];
+		// Where the trailing tags (the stack of all found) begin
+		size_t	begin;
+	};
+
+	// One backward pass from f_data + f_end over the stack of trailing tags
+	// in any order (each kind once). Returns the size of the stack; see
+	// IAPE::getTrailingSize for ErrTruncated and status offsets. A footer is
+	// only found within the data, so the stack may continue before f_data if
+	// the layout begins within 128 bytes of it.
+	size_t locateTail(const unsigned char* f_data, size_t f_end, TailLayout& f_layout, Status& f_status);
+
+
+	// Finds and parses the tags of a file reading only what they occupy: the head
+	// (sized from the ID3v2 header) and a tail window that grows backwards as
+	// trailing tags are found. The tags are copies, so the file is not kept open.
+	// Status offsets are file offsets here.
+	class IFile
+	{
+	public:
+		enum Access
+		{
+			AccessRead,	// pread
+			AccessMap	// Read-only mmap (only the touched pages are read)
+		};
+
+		static std::shared_ptr<IFile>	create	(const std::string& f_path, Access f_access = AccessRead);
+		static std::shared_ptr<IFile>	create	(const std::string& f_path, Status& f_status, Access f_access = AccessRead);
+		// The descriptor is not closed (nor is its position changed)
+		static std::shared_ptr<IFile>	create	(int f_fd, Access f_access = AccessRead);
+		static std::shared_ptr<IFile>	create	(int f_fd, Status& f_status, Access f_access = AccessRead);
+		// Tags over the limits are not read
+		static std::shared_ptr<IFile>	create	(const std::string& f_path, const Limits& f_limits, Status& f_status, Access f_access = AccessRead);
+		static std::shared_ptr<IFile>	create	(int f_fd, const Limits& f_limits, Status& f_status, Access f_access = AccessRead);
+
+	public:
+		virtual size_t							getSize		() const	= 0;
+		// The number of bytes read to locate and parse the tags
+		virtual size_t							getBytesRead() const	= 0;
+
+		// The audio payload: [start, end) between the leading and the trailing tags
+		virtual size_t							getAudioStart() const	= 0;
+		virtual size_t							getAudioEnd	() const	= 0;
+
+		// nullptr if there is no tag
+		virtual std::shared_ptr<IID3v2>			getID3v2	() const	= 0;
+		virtual std::shared_ptr<IID3v1>			getID3v1	() const	= 0;
+		virtual std::shared_ptr<IAPE>			getAPE		() const	= 0;
+		virtual std::shared_ptr<ILyrics>		getLyrics	() const	= 0;
+		// ErrUnsupported if the file begins with an ID3v2 tag that is not parsed
+		// (v2.2, unsynchronisation, ...): getID3v2() is nullptr, but the audio
+		// starts after the tag and the trailing tags are found
+		virtual Status							getID3v2Status() const	= 0;
+
+		virtual ~IFile();
+	};
+
+
+	// The steps of IFile::create for callers doing the reads themselves (an
+	// event loop, coroutines): the head window, the head, then tail windows
+	// growing backwards until loadTail is done
+	class IFileLoader
+	{
+	public:
+		static std::shared_ptr<IFileLoader>	create	(size_t f_fileSize, const Limits& f_limits = Limits::none());
+
+	public:
+		// The first read: [0, getHeadWindow())
+		virtual size_t					getHeadWindow	() const	= 0;
+		// f_data is the head window: returns the size of the head to read
+		virtual size_t					getHeadSize		(const unsigned char* f_data) const	= 0;
+		// f_data has getHeadSize() bytes
+		virtual Status					loadHead		(const unsigned char* f_data)	= 0;
+
+		// The offset of the first tail window (after loadHead)
+		virtual size_t					getTailOffset	() const	= 0;
+		// f_data is the file from f_offset to the end. Returns the offset to
+		// extend the window to (with ErrTruncated) or f_offset when done.
+		virtual size_t					loadTail		(const unsigned char* f_data, size_t f_offset, Status& f_status)	= 0;
+
+		// After the tail is done: f_bytesRead is reported by IFile::getBytesRead
+		virtual std::shared_ptr<IFile>	getFile			(size_t f_bytesRead)	= 0;
+
+		virtual ~IFileLoader();
+	};
+
+
+	// Writes f_tag (from any source) as the ID3v2 tag of a file. It goes into
+	// the slot of the old tag (with its padding) when it fits: the slot is
+	// written in place and the audio is not touched. Otherwise the file is
+	// rewritten as with rewriteFile (hard links are not kept).
+	// A rewritten tag is padded as IPaddingPolicy::createBlock() chooses.
+	// After a save f_tag is reloaded from what was written (its sizes are
+	// those in the file; references from its getters are invalidated).
+	// Returns true if the tag was written in place.
+	bool saveID3v2(const std::string& f_path, IID3v2& f_tag, Status& f_status);
+	// A rewritten tag is padded as f_policy chooses and every successful save
+	// is reported to it (the frames before the save and as written)
+	bool saveID3v2(const std::string& f_path, IID3v2& f_tag, IPaddingPolicy& f_policy, Status& f_status);
+
+	// The tags kept by rewriteFile
+	enum Keep : unsigned
+	{
+		KeepNone	= 0,
+		KeepID3v2	= 1u << 0,
+		KeepID3v1	= 1u << 1,
+		KeepAPE		= 1u << 2,
+		KeepLyrics	= 1u << 3,
+		KeepAll		= KeepID3v2 | KeepID3v1 | KeepAPE | KeepLyrics
+	};
+	// Rewrites a file as f_head (a new ID3v2 tag), the audio and f_tail (new
+	// trailing tags). The tags in f_keep stay (the trailing ones in their
+	// order, before f_tail) and the others are dropped, e.g. KeepNone strips
+	// the file. The audio is moved by the kernel (reflinks where the file
+	// system has them) and a new file is renamed over the old one.
+	Status rewriteFile(const std::string& f_path, unsigned f_keep, const Span& f_head = Span{nullptr, 0}, const Span& f_tail = Span{nullptr, 0});
+
+
+	// Locates the tags of many files at once: the head and the tail reads of
+	// all the files are queued together (io_uring, or a pool of threads)
+	class IBatch
+	{
+	public:
+		// f_file is nullptr on error. Called on the scanning thread in the
+		// order the files complete.
+		using Callback = std::function<void(size_t f_index, const Status& f_status, const std::shared_ptr<IFile>& f_file)>;
+
+		enum Order
+		{
+			OrderGiven,
+			// By the physical block of each file (FIEMAP, FIBMAP), else by
+			// the inode: fewer seeks on disks and network block devices
+			OrderPhysical
+		};
+
+		// Of the last scan. A seek is a read not starting right after the
+		// previous one (counted where the blocks are known, OrderPhysical only).
+		struct Stats
+		{
+			size_t	reads;
+			size_t	seeks;
+			size_t	seeksGiven;	// Had the files been read in the given order
+		};
+
+		// f_depth is the number of reads in flight
+		static std::shared_ptr<IBatch>	create	(unsigned f_depth = 256, Order f_order = OrderPhysical);
+
+	public:
+		virtual bool	isIOUring	() const	= 0;
+
+		// Equal to IFile::create for each path (AccessRead)
+		virtual void	scan		(const std::vector<std::string>& f_paths, const Callback& f_callback)	= 0;
+		virtual Stats	getStats	() const	= 0;
+		// For the following scans (see IFile::create)
+		virtual void	setLimits	(const Limits& f_limits)	= 0;
+
+		virtual ~IBatch();
+	};
+
+
 	const std::string&	genre(unsigned f_index);
 	int					genre(const std::string& f_text);
 }
@@ -0,0 +1,58 @@
+#include "tag.h"
+
+#include "common.h"
+
+
+namespace Tag
+{
+	size_t locateTail(const unsigned char* f_data, size_t f_end, TailLayout& f_layout, Status& f_status)
+	{
+		using getTrailingSize_t = size_t (*)(const unsigned char* f_data, size_t f_end, Status& f_status);
+		static const getTrailingSize_t s_fns[TailLayout::KindCount] =
+		{
+			&IID3v1::getTrailingSize,
+			&IAPE::getTrailingSize,
+			&ILyrics::getTrailingSize
+		};
+
+		f_status = Status{Status::ErrNone, 0};
+		for(auto& tag : f_layout.tags)
+			tag = TailLayout::Region{0, 0};
+
+		// Every step peels off one tag that ends where the previous one begins
+		auto end = f_end;
+		for(bool found = true; found;)
+		{
+			found = false;
+			for(uint kind = 0; kind < TailLayout::KindCount; ++kind)
+			{
+				auto& tag = f_layout.tags[kind];
+				if(tag.size)
+					continue;
+
+				auto size = s_fns[kind](f_data, end, f_status);
+				if(f_status.error == Status::ErrNotFound)
+					continue;
+				if(f_status.error == Status::ErrTruncated)
+				{
+					// The window must include the stack up to here and the tag
+					f_layout.begin = end;
+					return f_end - end + size;
+				}
+				if(!f_status.ok())
+				{
+					f_layout.begin = end;
+					return 0;
+				}
+
+				end -= size;
+				tag = TailLayout::Region{end, size};
+				found = true;
+			}
+		}
+
+		f_status = Status{Status::ErrNone, 0};
+		f_layout.begin = end;
+		return f_end - end;
+	}
+}
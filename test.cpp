@@ -2,40 +2,21 @@
 
 #include "tag.h"
 
-#include <cstdio>
-
 
 #define LOG(msg)	std::cout << msg << std::endl
 //#define ERROR(msg)  do { std::cerr << "ERROR @ " << __FILE__ << ":" << __LINE__ << ": " << msg << std::endl; } while(0)
 
 
-static void printTagV1(FILE* f)
+static void printTagV1(const Tag::IFile& f_file)
 {
-	auto tagSize = Tag::IID3v1::size();
-	if(fseek(f, -static_cast<long>(tagSize), SEEK_END) == -1)
-	{
-		LOG("No ID3v1 tag (file too small)");
-		return;
-	}
-
-	std::vector<uchar> buf(tagSize);
-
-	if(fread(&buf[0], buf.size(), 1, f) != 1)
-	{
-		LOG("Failed to read " << buf.size() << " bytes");
-		return;
-	}
-
 	LOG("ID3v1" << std::endl << "================");
-	tagSize = Tag::IID3v1::getSize(&buf[0], 0, buf.size());
-	if(!tagSize)
+	auto tag = f_file.getID3v1();
+	if(!tag)
 	{
 		LOG("No ID3v1 tag");
 		return;
 	}
 
-	auto tag = Tag::IID3v1::create(&buf[0], 0, tagSize);
-
 	LOG("Title:   " << tag->getTitle());
 	LOG("Artist:  " << tag->getArtist());
 	LOG("Album:   " << tag->getAlbum());
@@ -92,29 +73,17 @@ static void printFrames(const std::string& f_name, const Tag::IID3v2& f_tag, tag
 	}
 }
 
-static void printTagV2(FILE* f)
+static void printTagV2(const Tag::IFile& f_file)
 {
-	fseek(f, 0, SEEK_END);
-	auto fsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
-
-	std::vector<uchar> buf(fsize);
-	if(fread(&buf[0], fsize, 1, f) != 1)
-	{
-		LOG("Failed to read the file");
-		return;
-	}
-
 	LOG("ID3v2" << std::endl << "================");
-	auto tagSize = Tag::IID3v2::getSize(&buf[0], 0, fsize);
-	if(!tagSize)
+	auto tag = f_file.getID3v2();
+	if(!tag)
 	{
-		LOG("No ID3v2 tag");
+		auto status = f_file.getID3v2Status();
+		LOG((status.ok() ? std::string("No ID3v2 tag") : status.str()));
 		return;
 	}
 
-	auto tag = Tag::IID3v2::create(&buf[0], 0, tagSize);
-
 #define PRINT_FRAMES(Name, ExFn)	printFrames(#Name, *tag, &Tag::IID3v2::get##Name##Count, &Tag::IID3v2::get##Name, ExFn)
 #define PRINT(Name)					PRINT_FRAMES(Name, nullptr)
 
@@ -136,6 +105,14 @@ static void printTagV2(FILE* f)
 	PRINT(URL);
 	PRINT(Encoded);
 
+	for(uint i = 0, n = tag->getPictureCount(); i < n; ++i)
+	{
+		// A handle: the image itself is not read
+		auto picture = tag->getPicture(i);
+		LOG(makeAlignedCaption("Picture", n > 1 ? static_cast<int>(i) : -1) << ' ' << picture.mime << ", type " << picture.type << ", " <<
+			picture.size << " bytes @ " << picture.offset << (picture.description.empty() ? "" : ", " + picture.description));
+	}
+
 	std::vector<std::string> uframes = tag->getUnknownFrames();
 	if(auto n = uframes.size())
 	{
@@ -144,67 +121,48 @@ static void printTagV2(FILE* f)
 			std::cout << " " << uframes[i];
 		std::cout << std::endl;
 	}
+
+	for(uint i = 0, n = tag->getDiagnosticCount(); i < n; ++i)
+		std::cout << "Diagnostic      : " << tag->getDiagnostic(i).str() << std::endl;
 }
 
 // ================
-static void printTagAPE(FILE* f)
+static void printTagAPE(const Tag::IFile& f_file)
 {
-	uint offset = 7051931;//0x317770;
-
-	fseek(f, 0, SEEK_END);
-	long fsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
-
-	if(fseek(f, offset, SEEK_SET) == -1)
-	{
-		LOG("APE tag not found");;
-		return;
-	}
-
-	std::vector<uchar> buf(fsize - offset);
-
-	if(fread(&buf[0], buf.size(), 1, f) != 1)
-	{
-		LOG("Failed to read " << buf.size() << " bytes");
-		return;
-	}
-
 	LOG("APE" << std::endl << "================");
-	size_t relOffset = 2157 - 1931;
-	auto tagSize = Tag::IAPE::getSize(&buf[0], relOffset, buf.size());
-	if(!tagSize)
-	{
+	if(auto tag = f_file.getAPE())
+		LOG("Tag OK (" << tag->getSize() << " bytes)");
+	else
 		LOG("No tag");
-		return;
-	}
-	auto nextOffset = relOffset + tagSize;
-	if(nextOffset < relOffset)
-	{
-		relOffset = nextOffset;
-		tagSize = Tag::IAPE::getSize(&buf[0], relOffset, tagSize);
-	}
+}
 
-	auto tag = Tag::IAPE::create(&buf[0], relOffset, tagSize);
-	LOG("Tag OK");
+static void printTagLyrics(const Tag::IFile& f_file)
+{
+	LOG("Lyrics3" << std::endl << "================");
+	if(auto tag = f_file.getLyrics())
+		LOG("Tag OK (" << tag->getSize() << " bytes)");
+	else
+		LOG("No tag");
 }
 
 // ====================================
 static void test_file(const char* f_path)
 {
-	if(FILE* f = fopen(f_path, "rb"))
+	Tag::Status status;
+	if(auto file = Tag::IFile::create(f_path, status))
 	{
-		LOG("Checking \"" << f_path << "\"...");
+		LOG("Checking \"" << f_path << "\" (" << file->getBytesRead() << " of " << file->getSize() << " bytes read)...");
 
-		printTagV1(f);
+		printTagV1(*file);
 		LOG("");
-		printTagV2(f);
+		printTagV2(*file);
 		LOG("");
-		printTagAPE(f);
-
-		fclose(f);
+		printTagAPE(*file);
+		LOG("");
+		printTagLyrics(*file);
 	}
 	else
-		LOG("Failed to open \"" << f_path << "\"");
+		LOG("Failed to open \"" << f_path << "\": " << status.str());
 }
 
 
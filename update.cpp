@@ -0,0 +1,307 @@
+#include "tag.h"
+
+#include "common.h"
+#include "id3v2.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio> // rename
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fs.h> // FICLONERANGE
+#include <sys/ioctl.h>
+#endif
+
+
+using Tag::Status;
+
+
+static bool writeAll(int f_fd, const uchar* f_data, size_t f_size, size_t f_offset)
+{
+	while(f_size)
+	{
+		auto n = pwrite(f_fd, f_data, f_size, f_offset);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		f_data += n;
+		f_offset += n;
+		f_size -= n;
+	}
+	return true;
+}
+
+
+// The size of the ID3v2 tag the file begins with (0 if there is none)
+static Status getSlot(int f_fd, size_t& f_slot)
+{
+	uchar header[sizeof(CID3v2::Tag_t::Header_t)];
+	long n;
+	do
+		n = pread(f_fd, header, sizeof(header), 0);
+	while(n == -1 && errno == EINTR);
+	if(n == -1)
+		return Status{Status::ErrIO, 0};
+
+	Tag::Probe probe;
+	Status status;
+	f_slot = Tag::IID3v2::probe(header, 0, n, probe, status);
+
+	struct stat st;
+	if(fstat(f_fd, &st) == -1)
+		return Status{Status::ErrIO, 0};
+	if(f_slot > static_cast<size_t>(st.st_size))
+		return Status{Status::ErrTruncated, static_cast<size_t>(st.st_size)};
+	return Status{Status::ErrNone, 0};
+}
+
+
+// Moves f_size bytes between files: the kernel copies them or, with reflinks,
+// only shares the blocks. They never pass through a buffer of ours on Linux.
+static bool copyRange(int f_in, size_t f_inOffset, int f_out, size_t f_outOffset, size_t f_size)
+{
+#if defined(__linux__)
+#if defined(FICLONERANGE)
+	// Btrfs, XFS: the offsets must be on block boundaries, and so must the
+	// end unless it is the end of the file
+	struct stat st;
+	if(f_size && fstat(f_in, &st) == 0 && st.st_blksize > 0)
+	{
+		size_t block = st.st_blksize;
+		auto size = (f_inOffset + f_size == static_cast<size_t>(st.st_size)) ? f_size : f_size / block * block;
+		file_clone_range range;
+		range.src_fd = f_in;
+		range.src_offset = f_inOffset;
+		range.src_length = size;
+		range.dest_offset = f_outOffset;
+		if(size && !(f_inOffset % block) && !(f_outOffset % block) && ioctl(f_out, FICLONERANGE, &range) == 0)
+		{
+			f_inOffset += size;
+			f_outOffset += size;
+			f_size -= size;
+		}
+	}
+#endif
+
+	// Within a file system (other file systems: since Linux 5.3)
+	while(f_size)
+	{
+		loff_t in = f_inOffset;
+		loff_t out = f_outOffset;
+		auto n = copy_file_range(f_in, &in, f_out, &out, f_size, 0);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n == 0)
+			return false;
+		if(n == -1)
+			break;
+		f_inOffset += n;
+		f_outOffset += n;
+		f_size -= n;
+	}
+	if(!f_size)
+		return true;
+
+	// Older kernels: through a pipe, which only holds page references
+	int pipeFds[2];
+	if(pipe2(pipeFds, O_CLOEXEC) == -1)
+		return false;
+	while(f_size)
+	{
+		loff_t in = f_inOffset;
+		auto n = splice(f_in, &in, pipeFds[1], nullptr, std::min<size_t>(f_size, 64 * 1024), SPLICE_F_MOVE);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		f_inOffset += n;
+		f_size -= n;
+		while(n)
+		{
+			loff_t out = f_outOffset;
+			auto w = splice(pipeFds[0], nullptr, f_out, &out, n, SPLICE_F_MOVE);
+			if(w == -1 && errno == EINTR)
+				continue;
+			if(w <= 0)
+				break;
+			f_outOffset += w;
+			n -= w;
+		}
+		if(n)
+			break;
+	}
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+	return !f_size;
+#else
+	std::vector<uchar> buffer(std::min<size_t>(f_size, 1 << 20));
+	while(f_size)
+	{
+		auto n = pread(f_in, buffer.data(), std::min(buffer.size(), f_size), f_inOffset);
+		if(n == -1 && errno == EINTR)
+			continue;
+		if(n <= 0 || !writeAll(f_out, buffer.data(), n, f_outOffset))
+			return false;
+		f_inOffset += n;
+		f_outOffset += n;
+		f_size -= n;
+	}
+	return true;
+#endif
+}
+
+
+// A part of a rewritten file: new bytes or a range of the old file
+struct Piece
+{
+	const uchar*	Data;	// nullptr for the old file
+	size_t			Offset;	// In the old file
+	size_t			Size;
+};
+
+// A new file made of f_head and f_pieces (with the mode of the old one), renamed over f_path
+static Status rewrite(const std::string& f_path, int f_fd, const Tag::GatherList& f_head, const std::vector<Piece>& f_pieces)
+{
+	struct stat st;
+	if(fstat(f_fd, &st) == -1)
+		return Status{Status::ErrIO, 0};
+
+	// Next to the file: rename() does not cross file systems
+	std::string temp = f_path + ".XXXXXX";
+	auto fd = mkstemp(&temp[0]);
+	if(fd == -1)
+		return Status{Status::ErrIO, 0};
+
+	bool ok = (fchmod(fd, st.st_mode & 07777) == 0 && f_head.write(fd, 0));
+	auto offset = f_head.getSize();
+	for(auto& piece : f_pieces)
+	{
+		if(!ok)
+			break;
+		ok = piece.Data ? writeAll(fd, piece.Data, piece.Size, offset) : copyRange(f_fd, piece.Offset, fd, offset, piece.Size);
+		offset += piece.Size;
+	}
+	// The data must be on the disk before the new name is
+	ok = ok && fsync(fd) == 0;
+	ok = (close(fd) == 0) && ok;
+	if(!ok || rename(temp.c_str(), f_path.c_str()) == -1)
+	{
+		unlink(temp.c_str());
+		return Status{Status::ErrIO, 0};
+	}
+	return Status{Status::ErrNone, 0};
+}
+
+// ====================================
+namespace Tag
+{
+	bool saveID3v2(const std::string& f_path, IID3v2& f_tag, Status& f_status)
+	{
+		// Stateless: shared by all threads
+		static const auto s_policy = IPaddingPolicy::createBlock();
+		return saveID3v2(f_path, f_tag, *s_policy, f_status);
+	}
+
+	bool saveID3v2(const std::string& f_path, IID3v2& f_tag, IPaddingPolicy& f_policy, Status& f_status)
+	{
+		auto fd = ::open(f_path.c_str(), O_RDWR | O_CLOEXEC);
+		if(fd == -1)
+		{
+			f_status = Status{Status::ErrIO, 0};
+			return false;
+		}
+
+		size_t slot = 0;
+		f_status = getSlot(fd, slot);
+		bool inPlace = false;
+		if(f_status.ok())
+		{
+			// Unchanged frames go from the tag to the file (copied if they
+			// move within a mapping of the slot the tag is written to)
+			auto& source = static_cast<CID3v2&>(f_tag);
+			GatherList tag;
+			auto before = source.getFramesSize();
+			auto after = source.serialize(tag, slot, &f_policy, true);
+			inPlace = (tag.getSize() == slot);
+			if(inPlace)
+				f_status = tag.write(fd, 0) ? Status{Status::ErrNone, 0} : Status{Status::ErrIO, 0};
+			else
+			{
+				struct stat st;
+				f_status = (fstat(fd, &st) == -1) ? Status{Status::ErrIO, 0} :
+					rewrite(f_path, fd, tag, {Piece{nullptr, slot, st.st_size - slot}});
+			}
+
+			// The next save grows from what was written
+			if(f_status.ok())
+			{
+				f_policy.onEdit(before, after);
+				source.reload(tag);
+			}
+		}
+
+		close(fd);
+		return inPlace && f_status.ok();
+	}
+
+
+	Status rewriteFile(const std::string& f_path, unsigned f_keep, const Span& f_head, const Span& f_tail)
+	{
+		ASSERT_MSG(!(f_keep & KeepID3v2) || !f_head.size, "Two ID3v2 tags");
+
+		auto fd = ::open(f_path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd == -1)
+			return Status{Status::ErrIO, 0};
+		Status status{Status::ErrNone, 0};
+		auto file = IFile::create(fd, status);
+		if(!file)
+		{
+			close(fd);
+			return status;
+		}
+
+		GatherList head;
+		head.addSpan(f_head.data, f_head.size);
+		std::vector<Piece> pieces;
+		if(f_keep & KeepID3v2)
+			pieces.push_back(Piece{nullptr, 0, file->getAudioStart()});
+		pieces.push_back(Piece{nullptr, file->getAudioStart(), file->getAudioEnd() - file->getAudioStart()});
+
+		// The trailing tags kept stay in their order
+		auto tailSize = file->getSize() - file->getAudioEnd();
+		if((f_keep & (KeepID3v1 | KeepAPE | KeepLyrics)) && tailSize)
+		{
+			std::vector<uchar> tail(tailSize);
+			TailLayout layout;
+			if(pread(fd, tail.data(), tailSize, file->getAudioEnd()) != static_cast<long>(tailSize))
+				status = Status{Status::ErrIO, file->getAudioEnd()};
+			else
+				locateTail(tail.data(), tailSize, layout, status);
+			if(!status.ok())
+			{
+				close(fd);
+				return status;
+			}
+
+			const unsigned keep[TailLayout::KindCount] = {KeepID3v1, KeepAPE, KeepLyrics};
+			std::vector<Piece> kept;
+			for(uint kind = 0; kind < TailLayout::KindCount; ++kind)
+			{
+				auto& region = layout.tags[kind];
+				if((f_keep & keep[kind]) && region.size)
+					kept.push_back(Piece{nullptr, file->getAudioEnd() + region.offset, region.size});
+			}
+			std::sort(kept.begin(), kept.end(), [](const Piece& f_a, const Piece& f_b){ return f_a.Offset < f_b.Offset; });
+			pieces.insert(pieces.end(), kept.begin(), kept.end());
+		}
+		if(f_tail.size)
+			pieces.push_back(Piece{f_tail.data, 0, f_tail.size});
+
+		status = rewrite(f_path, fd, head, pieces);
+		close(fd);
+		return status;
+	}
+}
@@ -2,42 +2,287 @@
 
 #include "common.h"
 
-#include <vector>
-#include <cstring> // memcpy
-#include <cerrno>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-#include <iconv.h>
+
+// ============================================================================
+// Scalar converters (return the end of the output)
+static char* latin1ToUTF8(const uchar* f_in, size_t f_size, char* f_out)
+{
+	for(auto end = f_in + f_size; f_in != end; ++f_in)
+	{
+		uchar c = *f_in;
+		if(c < 0x80)
+			*f_out++ = c;
+		else
+		{
+			*f_out++ = 0xC0 | (c >> 6);
+			*f_out++ = 0x80 | (c & 0x3F);
+		}
+	}
+	return f_out;
+}
+
+
+static ushort getU16(const uchar* f_in, bool f_bigEndian)
+{
+	return f_bigEndian ? ((f_in[0] << 8) | f_in[1]) : ((f_in[1] << 8) | f_in[0]);
+}
+
+// Returns the number of consumed bytes (2 or 4)
+static size_t u16ToUTF8(const uchar* f_in, size_t f_size, bool f_bigEndian, char*& f_out)
+{
+	uint c = getU16(f_in, f_bigEndian);
+
+	if(c < 0x80)
+	{
+		*f_out++ = c;
+		return 2;
+	}
+	if(c < 0x800)
+	{
+		*f_out++ = 0xC0 | (c >> 6);
+		*f_out++ = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	if(c < 0xD800 || c > 0xDFFF)
+	{
+		*f_out++ = 0xE0 | (c >> 12);
+		*f_out++ = 0x80 | ((c >> 6) & 0x3F);
+		*f_out++ = 0x80 | (c & 0x3F);
+		return 2;
+	}
+
+	// Surrogate pair
+	ASSERT_MSG(c < 0xDC00, "Invalid multi-byte sequence");
+	ASSERT_MSG(f_size >= 4, "Incomplete mutli-byte sequence");
+	uint low = getU16(f_in + 2, f_bigEndian);
+	ASSERT_MSG(low >= 0xDC00 && low <= 0xDFFF, "Invalid multi-byte sequence");
+
+	c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+	*f_out++ = 0xF0 | (c >> 18);
+	*f_out++ = 0x80 | ((c >> 12) & 0x3F);
+	*f_out++ = 0x80 | ((c >> 6) & 0x3F);
+	*f_out++ = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+// ============================================================================
+// Vectorized ASCII runs: every block is either copied/narrowed as is or
+// handed over to the scalar converter
+std::string UTF8::fromLatin1(const char* f_data, size_t f_size)
+{
+	std::string str;
+	if(!f_size)
+		return str;
+
+	// 2 bytes max for a Latin-1 character
+	str.resize(f_size * 2);
+	auto pIn = reinterpret_cast<const uchar*>(f_data);
+	auto pOut = &str[0];
+
+	for(size_t i = 0; i < f_size;)
+	{
+		auto n = f_size - i;
+#if defined(__AVX2__)
+		if(n >= 32)
+		{
+			auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIn + i));
+			if(!_mm256_movemask_epi8(v))
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(pOut), v);
+				i += 32;
+				pOut += 32;
+				continue;
+			}
+		}
+#endif
+#if defined(__SSE2__)
+		if(n >= 16)
+		{
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i));
+			if(!_mm_movemask_epi8(v))
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut), v);
+				i += 16;
+				pOut += 16;
+				continue;
+			}
+		}
+#endif
+		if(n > 16)
+			n = 16;
+		pOut = latin1ToUTF8(pIn + i, n, pOut);
+		i += n;
+	}
+
+	str.resize(pOut - &str[0]);
+	return str;
+}
+
+
+std::string UTF8::fromUCS2(const char* f_data, size_t f_size)
+{
+	auto p = reinterpret_cast<const uchar*>(f_data);
+	if(f_size >= 2)
+	{
+		if(p[0] == 0xFF && p[1] == 0xFE)
+			return fromU16(f_data + 2, f_size - 2, false);
+		if(p[0] == 0xFE && p[1] == 0xFF)
+			return fromU16(f_data + 2, f_size - 2, true);
+	}
+	return fromU16(f_data, f_size, false);
+}
 
 
-std::string UTF8::fromU16(const char* f_data, size_t f_size, const char* f_format)
+std::string UTF8::fromU16(const char* f_data, size_t f_size, bool f_bigEndian)
 {
-	iconv_t cd = iconv_open("UTF-8", f_format);
-	ASSERT(cd != iconv_t(-1));
+	auto size = findNull16(f_data, f_size);
+	ASSERT_MSG(!(size & 1), "Incomplete mutli-byte sequence");
+
+	auto pIn = reinterpret_cast<const uchar*>(f_data);
+	if(f_bigEndian && size >= 2 && pIn[0] == 0xFE && pIn[1] == 0xFF)
+	{
+		pIn += 2;
+		size -= 2;
+	}
 
-	std::vector<char> bufIn(f_size);
-	char* pIn = &bufIn[0];
-	memcpy(pIn, f_data, f_size);
-	size_t sizeIn = bufIn.size();;
+	std::string str;
+	if(!size)
+		return str;
 
-	std::vector<char> bufOut((f_size + 2/*UTF-16(NULL)*/) * 2 /*chars * 4 (max for UTF-8)*/);
-	char* pOut = &bufOut[0];
-	size_t sizeOut = bufOut.size();
+	// 3 bytes max for a BMP character, 4 bytes for a surrogate pair
+	str.resize(size / 2 * 3);
+	auto pOut = &str[0];
 
-	size_t nNonReversible = iconv(cd, &pIn, &sizeIn, &pOut, &sizeOut);
-	if(nNonReversible == size_t(-1))
+	for(size_t i = 0; i < size;)
 	{
-		switch(errno)
+		auto n = size - i;
+#if defined(__AVX2__)
+		if(n >= 32)
+		{
+			auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pIn + i));
+			if(f_bigEndian)
+				v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+			auto high = _mm256_and_si256(v, _mm256_set1_epi16(static_cast<short>(0xFF80)));
+			if(static_cast<uint>(_mm256_movemask_epi8(_mm256_cmpeq_epi16(high, _mm256_setzero_si256()))) == 0xFFFFFFFF)
+			{
+				// packus works within 128-bit lanes: gather both low quadwords
+				auto packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(pOut), _mm256_castsi256_si128(packed));
+				i += 32;
+				pOut += 16;
+				continue;
+			}
+		}
+#endif
+#if defined(__SSE2__)
+		if(n >= 16)
 		{
-			case EILSEQ:    ASSERT(!"Invalid multi-byte sequence");
-			case EINVAL:    ASSERT(!"Incomplete mutli-byte sequence");
-			case E2BIG:     ASSERT(!"Output buffer is too small");
-			default:        ASSERT(!"Convesrion error");
+			auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pIn + i));
+			if(f_bigEndian)
+				v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+			auto high = _mm_and_si128(v, _mm_set1_epi16(static_cast<short>(0xFF80)));
+			if(_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF)
+			{
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(pOut), _mm_packus_epi16(v, v));
+				i += 16;
+				pOut += 8;
+				continue;
+			}
 		}
+#endif
+		for(auto end = i + (n > 16 ? 16 : n); i < end;)
+			i += u16ToUTF8(pIn + i, size - i, f_bigEndian, pOut);
+	}
+
+	str.resize(pOut - &str[0]);
+	return str;
+}
+
+
+size_t UTF8::findNull16(const char* f_data, size_t f_size)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	for(auto zero = _mm_setzero_si128(); i + 16 <= f_size; i += 16)
+	{
+		auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f_data + i));
+		// Both bits of a matching character are set, so the lowest one is even
+		if(auto mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero)))
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for(; i + 2 <= f_size; i += 2)
+	{
+		if(!f_data[i] && !f_data[i + 1])
+			return i;
+	}
+	return f_size;
+}
+
+
+// ============================================================================
+// Returns the code point at f_ioIndex and moves past it
+static uint nextCodePoint(const std::string& f_str, size_t& f_ioIndex)
+{
+	uint c = static_cast<uchar>(f_str[f_ioIndex++]);
+	if(c < 0x80)
+		return c;
+
+	uint n = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : 1;
+	ASSERT_MSG(c >= 0xC0 && c < 0xF8, "Invalid multi-byte sequence");
+	ASSERT_MSG(f_ioIndex + n <= f_str.size(), "Incomplete mutli-byte sequence");
+	c &= 0x3F >> n;
+	for(; n; --n)
+	{
+		uint next = static_cast<uchar>(f_str[f_ioIndex++]);
+		ASSERT_MSG((next & 0xC0) == 0x80, "Invalid multi-byte sequence");
+		c = (c << 6) | (next & 0x3F);
 	}
-	ASSERT(nNonReversible == 0);
-	*pOut = 0;
+	return c;
+}
 
-	iconv_close(cd);
 
-	return std::string(&bufOut[0]);
+bool UTF8::toLatin1(const std::string& f_str, std::string& f_out)
+{
+	f_out.clear();
+	for(size_t i = 0; i < f_str.size();)
+	{
+		auto c = nextCodePoint(f_str, i);
+		if(c > 0xFF)
+			return false;
+		f_out += static_cast<char>(c);
+	}
+	return true;
+}
+
+
+std::string UTF8::toUCS2(const std::string& f_str)
+{
+	std::string out("\xFF\xFE", 2);
+	auto append = [&out](uint f_c)
+	{
+		out += static_cast<char>(f_c & 0xFF);
+		out += static_cast<char>(f_c >> 8);
+	};
+
+	for(size_t i = 0; i < f_str.size();)
+	{
+		auto c = nextCodePoint(f_str, i);
+		if(c < 0x10000)
+			append(c);
+		else
+		{
+			c -= 0x10000;
+			append(0xD800 + (c >> 10));
+			append(0xDC00 + (c & 0x3FF));
+		}
+	}
+	return out;
 }
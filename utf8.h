@@ -10,12 +10,22 @@
 class UTF8
 {
 public:
-	static std::string fromUCS2   (const char* p, size_t sz) { return fromU16(p, sz, "UCS-2");    }
-	static std::string fromUTF16BE(const char* p, size_t sz) { return fromU16(p, sz, "UTF-16BE"); }
+	static std::string fromLatin1 (const char* p, size_t sz);
+	// UTF-16 with BOM (little-endian is assumed when there is no BOM)
+	static std::string fromUCS2   (const char* p, size_t sz);
+	static std::string fromUTF16BE(const char* p, size_t sz) { return fromU16(p, sz, true); }
+
+	// Returns the (even) offset of the first 16-bit NULL or sz if there is none
+	static size_t findNull16(const char* p, size_t sz);
+
+	// For encoding frames: false if a character is not in ISO-8859-1
+	static bool toLatin1(const std::string& str, std::string& out);
+	// UTF-16LE with BOM
+	static std::string toUCS2(const std::string& str);
 
 private:
-	static std::string fromU16(const char* f_data, size_t f_size, const char* f_format);
+	// Stops at the first NULL character
+	static std::string fromU16(const char* f_data, size_t f_size, bool f_bigEndian);
 };
 
 #endif //__UTF8_H__
-